@@ -13,6 +13,13 @@ char_to_uint32(char* str);
 void
 utf_holder_destroy(struct utf_holder holder);
 
+// heap counted by `--stats`, defined by the program
+extern char* HEAP_LABELS;
+void*
+xcw_malloc(char* subsystem, size_t size);
+void
+xcw_free(char* subsystem, void* ptr);
+
 struct utf_holder
 char_to_uint32(char* str)
 {
@@ -21,7 +28,7 @@ char_to_uint32(char* str)
   int length = 0, shift = 0;
 
   // there should be less than or same as the strlen of str
-  output = (FcChar32*)malloc(sizeof(FcChar32) * strlen(str));
+  output = (FcChar32*)xcw_malloc(HEAP_LABELS, sizeof(FcChar32) * strlen(str));
   if (!output) {
     puts("couldn't allocate mem for char_to_uint32");
   }
@@ -41,7 +48,7 @@ char_to_uint32(char* str)
 void
 utf_holder_destroy(struct utf_holder holder)
 {
-  free(holder.str);
+  xcw_free(HEAP_LABELS, holder.str);
 }
 
 #endif
@@ -0,0 +1,691 @@
+/*
+
+Licensed under the Apache License, Version 2.0 (the "License"); you may not use
+this file except in compliance with the License. You may obtain a copy of the
+License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software distributed
+under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+CONDITIONS OF ANY KIND, either express or implied. See the License for the
+specific language governing permissions and limitations under the License.
+
+*/
+
+/*
+ * Benchmark driver for x-window-selector.  This starts a headless Xvfb server,
+ * fills it with normal windows listed in _NET_CLIENT_LIST as a window manager
+ * would, runs the selector against them, and chooses a window by typing with
+ * XTest.  For each number of windows, it prints one line with the median of
+ * each measurement over several runs.
+ *
+ * Usage: x-window-selector-bench SELECTOR [WINDOWS...]
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <xcb/res.h>
+#include <xcb/xcb.h>
+#include <xcb/xcb_keysyms.h>
+#include <xcb/xtest.h>
+
+// -- types
+
+/**
+ * Measurements from one run of the selector.
+ *
+ * first_paint_us: time from starting the selector until its first overlay
+ *     window is mapped, in microseconds
+ * selection_us: time from the first overlay window being mapped until the
+ *     selector exits, in microseconds
+ * round_trips: round trips made by the selector, from its `--timings` output
+ * requests: requests sent by the selector, from its `--timings` output
+ * peak_pixmap_bytes: most memory used by the selector's pixmaps in the server
+ * heap_allocs: heap blocks allocated by the selector, from its `--stats` output
+ * live_resources: server resources the selector created and didn't free before
+ *     exiting, from its `--stats` output
+ * chosen: whether the selector printed one of the benchmark's windows
+ */
+typedef struct bench_run_t
+{
+  int64_t first_paint_us;
+  int64_t selection_us;
+  int64_t round_trips;
+  int64_t requests;
+  int64_t peak_pixmap_bytes;
+  int64_t heap_allocs;
+  int64_t live_resources;
+  int chosen;
+} bench_run_t;
+
+/**
+ * The X server the benchmark runs against.
+ *
+ * pid: process ID of Xvfb
+ * display: display name, eg. ":1"
+ * xcon: the benchmark's connection to the server
+ * xroot: the root window
+ * ksymbols: cached key symbols
+ * net_client_list: the _NET_CLIENT_LIST atom
+ * net_wm_window_type: the _NET_WM_WINDOW_TYPE atom
+ * net_wm_window_type_normal: the _NET_WM_WINDOW_TYPE_NORMAL atom
+ * state_home: directory used as the selector's `$XDG_STATE_HOME`, so that its
+ *     selection history starts out empty
+ * cache_home: directory used as the selector's `$XDG_CACHE_HOME`, so that the
+ *     user's glyph files are neither used nor written
+ */
+typedef struct bench_server_t
+{
+  pid_t pid;
+  char display[16];
+  xcb_connection_t* xcon;
+  xcb_window_t xroot;
+  xcb_key_symbols_t* ksymbols;
+  xcb_atom_t net_client_list;
+  xcb_atom_t net_wm_window_type;
+  xcb_atom_t net_wm_window_type_normal;
+  char state_home[64];
+  char cache_home[64];
+} bench_server_t;
+
+// -- constants
+
+/**
+ * Size of the screen of the Xvfb server.
+ */
+char* SCREEN_SIZE = "1920x1080x24";
+/**
+ * Width of the screen, matching `SCREEN_SIZE`.
+ */
+int SCREEN_WIDTH = 1920;
+/**
+ * Height of the screen, matching `SCREEN_SIZE`.
+ */
+int SCREEN_HEIGHT = 1080;
+/**
+ * Characters passed to the selector.
+ */
+char* CHARACTERS = "asdfghjkl";
+/**
+ * Number of distinct window classes given to the windows.
+ */
+int WINDOW_CLASSES = 8;
+/**
+ * Numbers of windows benchmarked if none are given.
+ */
+int DEFAULT_WINDOWS[] = { 10, 100, 1000 };
+/**
+ * Size of `DEFAULT_WINDOWS`.
+ */
+int DEFAULT_WINDOWS_SIZE = (sizeof(DEFAULT_WINDOWS) / sizeof(*DEFAULT_WINDOWS));
+/**
+ * Number of times the selector is run for each number of windows.
+ */
+int RUNS = 5;
+/**
+ * Time between key presses while choosing a window, in milliseconds.
+ */
+int KEY_INTERVAL = 1;
+/**
+ * Longest time a run may take before it's abandoned, in milliseconds.
+ */
+int RUN_TIMEOUT = 10000;
+
+// -- utilities
+
+/**
+ * Print a message to stderr and exit the process with a failure status.
+ */
+void
+bench_die(char* format, ...)
+{
+  va_list args;
+  va_start(args, format);
+  fprintf(stderr, "error: ");
+  vfprintf(stderr, format, args);
+  va_end(args);
+  exit(EXIT_FAILURE);
+}
+
+/**
+ * returns: time since an arbitrary point, in microseconds
+ */
+int64_t
+monotonic_us()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * Wait for the X server to handle every request sent so far.
+ */
+void
+bench_sync(bench_server_t* server)
+{
+  xcb_get_input_focus_cookie_t gifc = xcb_get_input_focus(server->xcon);
+  free(xcb_get_input_focus_reply(server->xcon, gifc, NULL));
+}
+
+xcb_atom_t
+bench_atom(bench_server_t* server, char* name)
+{
+  xcb_intern_atom_cookie_t iac =
+    xcb_intern_atom(server->xcon, 0, strlen(name), name);
+  xcb_intern_atom_reply_t* iar =
+    xcb_intern_atom_reply(server->xcon, iac, NULL);
+  if (iar == NULL)
+    bench_die("intern_atom: %s\n", name);
+  xcb_atom_t atom = iar->atom;
+  free(iar);
+  return atom;
+}
+
+/**
+ * returns: whether `window` was created by the benchmark's own connection
+ */
+int
+bench_owns(bench_server_t* server, xcb_window_t window)
+{
+  const xcb_setup_t* setup = xcb_get_setup(server->xcon);
+  return (window & ~setup->resource_id_mask) == setup->resource_id_base;
+}
+
+int
+int64_compare(const void* a, const void* b)
+{
+  int64_t x = *(const int64_t*)a;
+  int64_t y = *(const int64_t*)b;
+  return (x > y) - (x < y);
+}
+
+// -- server
+
+/**
+ * Start an Xvfb server on a free display and connect to it.
+ */
+void
+bench_server_start(bench_server_t* server)
+{
+  int fds[2];
+  if (pipe(fds) < 0)
+    bench_die("pipe: %s\n", strerror(errno));
+
+  server->pid = fork();
+  if (server->pid < 0) {
+    bench_die("fork: %s\n", strerror(errno));
+  } else if (server->pid == 0) {
+    close(fds[0]);
+    char displayfd[16];
+    snprintf(displayfd, sizeof(displayfd), "%d", fds[1]);
+    execlp("Xvfb",
+           "Xvfb",
+           "-displayfd",
+           displayfd,
+           "-screen",
+           "0",
+           SCREEN_SIZE,
+           "-nolisten",
+           "tcp",
+           NULL);
+    bench_die("Xvfb: %s\n", strerror(errno));
+  }
+
+  // Xvfb writes the display number once it's ready for clients
+  close(fds[1]);
+  char number[8];
+  int length = read(fds[0], number, sizeof(number) - 1);
+  close(fds[0]);
+  if (length <= 0)
+    bench_die("Xvfb didn't start\n");
+  number[length] = '\0';
+  number[strcspn(number, "\n")] = '\0';
+  snprintf(server->display, sizeof(server->display), ":%s", number);
+
+  int screen_number;
+  server->xcon = xcb_connect(server->display, &screen_number);
+  if (xcb_connection_has_error(server->xcon))
+    bench_die("connect to %s\n", server->display);
+  xcb_screen_iterator_t it =
+    xcb_setup_roots_iterator(xcb_get_setup(server->xcon));
+  for (int i = 0; i < screen_number; i++)
+    xcb_screen_next(&it);
+  server->xroot = it.data->root;
+  server->ksymbols = xcb_key_symbols_alloc(server->xcon);
+  server->net_client_list = bench_atom(server, "_NET_CLIENT_LIST");
+  server->net_wm_window_type = bench_atom(server, "_NET_WM_WINDOW_TYPE");
+  server->net_wm_window_type_normal =
+    bench_atom(server, "_NET_WM_WINDOW_TYPE_NORMAL");
+
+  // overlay windows are found through their MapNotify events
+  uint32_t mask = XCB_EVENT_MASK_SUBSTRUCTURE_NOTIFY;
+  xcb_change_window_attributes(
+    server->xcon, server->xroot, XCB_CW_EVENT_MASK, &mask);
+
+  strcpy(server->state_home, "/tmp/x-window-selector-bench-XXXXXX");
+  strcpy(server->cache_home, "/tmp/x-window-selector-bench-XXXXXX");
+  if (
+    mkdtemp(server->state_home) == NULL || mkdtemp(server->cache_home) == NULL)
+    bench_die("mkdtemp: %s\n", strerror(errno));
+}
+
+/**
+ * Remove a directory made by `bench_server_start`, and the files the selector
+ * left in it.
+ */
+void
+bench_dir_remove(char* path)
+{
+  DIR* dir = opendir(path);
+  struct dirent* entry;
+  while (dir != NULL && (entry = readdir(dir)) != NULL) {
+    char file[256];
+    snprintf(file, sizeof(file), "%s/%s", path, entry->d_name);
+    if (entry->d_name[0] != '.')
+      unlink(file);
+  }
+  if (dir != NULL)
+    closedir(dir);
+  rmdir(path);
+}
+
+void
+bench_server_stop(bench_server_t* server)
+{
+  xcb_key_symbols_free(server->ksymbols);
+  xcb_disconnect(server->xcon);
+  kill(server->pid, SIGTERM);
+  waitpid(server->pid, NULL, 0);
+  bench_dir_remove(server->state_home);
+  bench_dir_remove(server->cache_home);
+}
+
+/**
+ * Create and map windows in a grid covering the screen, as normal windows of
+ * a few classes, and list them in _NET_CLIENT_LIST.
+ *
+ * size: number of windows
+ *
+ * returns: the windows (to be freed by the caller)
+ */
+xcb_window_t*
+bench_windows_create(bench_server_t* server, int size)
+{
+  xcb_window_t* windows = calloc(size, sizeof(xcb_window_t));
+  int columns = 1;
+  while (columns * columns < size)
+    columns += 1;
+  int rows = (size + columns - 1) / columns;
+  int width = SCREEN_WIDTH / columns;
+  int height = SCREEN_HEIGHT / rows;
+
+  for (int i = 0; i < size; i++) {
+    windows[i] = xcb_generate_id(server->xcon);
+    xcb_create_window(server->xcon,
+                      XCB_COPY_FROM_PARENT,
+                      windows[i],
+                      server->xroot,
+                      (i % columns) * width,
+                      (i / columns) * height,
+                      width,
+                      height,
+                      0,
+                      XCB_WINDOW_CLASS_INPUT_OUTPUT,
+                      XCB_COPY_FROM_PARENT,
+                      0,
+                      NULL);
+    xcb_change_property(server->xcon,
+                        XCB_PROP_MODE_REPLACE,
+                        windows[i],
+                        server->net_wm_window_type,
+                        XCB_ATOM_ATOM,
+                        32,
+                        1,
+                        &(server->net_wm_window_type_normal));
+    // WM_CLASS is an instance name and a class name
+    char window_class[32];
+    int length = snprintf(window_class,
+                          sizeof(window_class),
+                          "bench%d%cBench%d",
+                          i % WINDOW_CLASSES,
+                          '\0',
+                          i % WINDOW_CLASSES);
+    xcb_change_property(server->xcon,
+                        XCB_PROP_MODE_REPLACE,
+                        windows[i],
+                        XCB_ATOM_WM_CLASS,
+                        XCB_ATOM_STRING,
+                        8,
+                        length + 1,
+                        window_class);
+    xcb_map_window(server->xcon, windows[i]);
+  }
+
+  xcb_change_property(server->xcon,
+                      XCB_PROP_MODE_REPLACE,
+                      server->xroot,
+                      server->net_client_list,
+                      XCB_ATOM_WINDOW,
+                      32,
+                      size,
+                      windows);
+  bench_sync(server);
+  // drop the MapNotify events for our own windows
+  xcb_generic_event_t* event;
+  while ((event = xcb_poll_for_event(server->xcon)))
+    free(event);
+  return windows;
+}
+
+void
+bench_windows_destroy(bench_server_t* server, xcb_window_t* windows, int size)
+{
+  for (int i = 0; i < size; i++)
+    xcb_destroy_window(server->xcon, windows[i]);
+  xcb_delete_property(server->xcon, server->xroot, server->net_client_list);
+  bench_sync(server);
+  free(windows);
+}
+
+/**
+ * returns: memory used by pixmaps of the client that created `window`, in
+ *     bytes, or -1 if the client has gone away
+ */
+int64_t
+bench_pixmap_bytes(bench_server_t* server, xcb_window_t window)
+{
+  xcb_res_query_client_pixmap_bytes_cookie_t qcpbc =
+    xcb_res_query_client_pixmap_bytes(server->xcon, window);
+  xcb_res_query_client_pixmap_bytes_reply_t* qcpbr =
+    xcb_res_query_client_pixmap_bytes_reply(server->xcon, qcpbc, NULL);
+  if (qcpbr == NULL)
+    return -1;
+  int64_t bytes = ((int64_t)qcpbr->bytes_overflow << 32) | qcpbr->bytes;
+  free(qcpbr);
+  return bytes;
+}
+
+/**
+ * Press and release a key with XTest.
+ */
+void
+bench_type(bench_server_t* server, xcb_keycode_t keycode)
+{
+  xcb_test_fake_input(
+    server->xcon, XCB_KEY_PRESS, keycode, XCB_CURRENT_TIME, XCB_NONE, 0, 0, 0);
+  xcb_test_fake_input(server->xcon,
+                      XCB_KEY_RELEASE,
+                      keycode,
+                      XCB_CURRENT_TIME,
+                      XCB_NONE,
+                      0,
+                      0,
+                      0);
+  xcb_flush(server->xcon);
+}
+
+// -- runs
+
+/**
+ * Start the selector with its output going to pipes.
+ *
+ * selector: path to the selector
+ * out_fd (output): read end of the selector's stdout
+ * err_fd (output): read end of the selector's stderr
+ *
+ * returns: process ID of the selector
+ */
+pid_t
+bench_spawn(bench_server_t* server, char* selector, int* out_fd, int* err_fd)
+{
+  int out[2];
+  int err[2];
+  if (pipe(out) < 0 || pipe(err) < 0)
+    bench_die("pipe: %s\n", strerror(errno));
+
+  pid_t pid = fork();
+  if (pid < 0) {
+    bench_die("fork: %s\n", strerror(errno));
+  } else if (pid == 0) {
+    dup2(out[1], STDOUT_FILENO);
+    dup2(err[1], STDERR_FILENO);
+    close(out[0]);
+    close(err[0]);
+    setenv("DISPLAY", server->display, 1);
+    setenv("XDG_STATE_HOME", server->state_home, 1);
+    setenv("XDG_CACHE_HOME", server->cache_home, 1);
+    execl(selector, selector, "--timings", "--stats", CHARACTERS, NULL);
+    bench_die("%s: %s\n", selector, strerror(errno));
+  }
+
+  close(out[1]);
+  close(err[1]);
+  *out_fd = out[0];
+  *err_fd = err[0];
+  return pid;
+}
+
+/**
+ * Read everything a pipe holds once its writer has exited.
+ */
+void
+bench_read_all(int fd, char* buffer, int size)
+{
+  int length = 0;
+  int count;
+  while (length < size - 1 &&
+         (count = read(fd, buffer + length, size - 1 - length)) > 0)
+    length += count;
+  buffer[length] = '\0';
+  close(fd);
+}
+
+/**
+ * returns: the value of `name=<value>` in the line of the selector's output
+ *     starting with `prefix`, or -1 if it isn't there
+ */
+int64_t
+bench_output_value(char* output, char* prefix, char* name)
+{
+  char* line = strstr(output, prefix);
+  char key[64];
+  snprintf(key, sizeof(key), " %s=", name);
+  char* found = line == NULL ? NULL : strstr(line, key);
+  if (found == NULL)
+    return -1;
+  return strtoll(found + strlen(key), NULL, 10);
+}
+
+/**
+ * Run the selector once and choose a window by pressing the first character
+ * repeatedly, which descends into the first label at each level.  Keys pressed
+ * before the selector has grabbed the keyboard go to other windows, so they
+ * make no difference.
+ */
+void
+bench_run(bench_server_t* server,
+          char* selector,
+          xcb_window_t* windows,
+          int size,
+          bench_run_t* run)
+{
+  bench_run_t none = { -1, -1, -1, -1, -1, -1, -1, 0 };
+  *run = none;
+  xcb_keycode_t* keycodes =
+    xcb_key_symbols_get_keycode(server->ksymbols, CHARACTERS[0]);
+  if (keycodes == NULL || keycodes[0] == XCB_NO_SYMBOL)
+    bench_die("no keycode for '%c'\n", CHARACTERS[0]);
+  xcb_keycode_t keycode = keycodes[0];
+  free(keycodes);
+
+  int out_fd;
+  int err_fd;
+  int64_t start = monotonic_us();
+  pid_t pid = bench_spawn(server, selector, &out_fd, &err_fd);
+  int64_t painted = -1;
+  xcb_window_t overlay = XCB_NONE;
+  int status;
+  pid_t exited;
+
+  struct pollfd pfd = { xcb_get_file_descriptor(server->xcon), POLLIN, 0 };
+  while ((exited = waitpid(pid, &status, WNOHANG)) == 0) {
+    if (monotonic_us() - start > (int64_t)RUN_TIMEOUT * 1000) {
+      kill(pid, SIGKILL);
+      waitpid(pid, &status, 0);
+      break;
+    }
+
+    poll(&pfd, 1, KEY_INTERVAL);
+    xcb_generic_event_t* event;
+    while ((event = xcb_poll_for_event(server->xcon))) {
+      if ((event->response_type & ~0x80) == XCB_MAP_NOTIFY) {
+        xcb_map_notify_event_t* mn = (xcb_map_notify_event_t*)event;
+        if (painted < 0 && !bench_owns(server, mn->window)) {
+          painted = monotonic_us();
+          overlay = mn->window;
+        }
+      }
+      free(event);
+    }
+
+    if (painted >= 0) {
+      int64_t bytes = bench_pixmap_bytes(server, overlay);
+      if (bytes > run->peak_pixmap_bytes)
+        run->peak_pixmap_bytes = bytes;
+      bench_type(server, keycode);
+    }
+  }
+  int64_t end = monotonic_us();
+
+  char out[64];
+  char err[16384];
+  bench_read_all(out_fd, out, sizeof(out));
+  bench_read_all(err_fd, err, sizeof(err));
+  if (exited < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    fprintf(stderr, "selector failed: %s", err);
+
+  // a single window is chosen without drawing anything
+  if (painted >= 0) {
+    run->first_paint_us = painted - start;
+    run->selection_us = end - painted;
+  }
+  run->round_trips = bench_output_value(err, "timings:", "total_rt");
+  run->requests = bench_output_value(err, "timings:", "total_requests");
+  run->heap_allocs = bench_output_value(err, "stats:", "heap_allocs");
+  run->live_resources = bench_output_value(err, "stats:", "live_resources");
+  char* out_end;
+  xcb_window_t chosen = strtoul(out, &out_end, 0);
+  for (int i = 0; out_end != out && i < size; i++) {
+    if (windows[i] == chosen)
+      run->chosen = 1;
+  }
+}
+
+/**
+ * returns: the median over `runs` of the measurement at `offset` in a
+ *     `bench_run_t`
+ */
+int64_t
+bench_runs_median(bench_run_t* runs, int runs_size, size_t offset)
+{
+  int64_t* values = calloc(runs_size, sizeof(int64_t));
+  for (int i = 0; i < runs_size; i++)
+    values[i] = *(int64_t*)((char*)&(runs[i]) + offset);
+  qsort(values, runs_size, sizeof(*values), int64_compare);
+  int64_t value = values[runs_size / 2];
+  free(values);
+  return value;
+}
+
+/**
+ * Print the median of each measurement over `runs` on one line.
+ */
+void
+bench_report(int size, bench_run_t* runs, int runs_size)
+{
+  int failures = 0;
+  for (int i = 0; i < runs_size; i++)
+    failures += !runs[i].chosen;
+  int64_t first_paint_us =
+    bench_runs_median(runs, runs_size, offsetof(bench_run_t, first_paint_us));
+  int64_t selection_us =
+    bench_runs_median(runs, runs_size, offsetof(bench_run_t, selection_us));
+
+  printf("windows=%d first_paint_ms=%" PRId64 ".%03d selection_ms=%" PRId64
+         ".%03d round_trips=%" PRId64 " requests=%" PRId64
+         " peak_pixmap_bytes=%" PRId64 " heap_allocs=%" PRId64
+         " live_resources=%" PRId64 " failures=%d\n",
+         size,
+         first_paint_us / 1000,
+         (int)(first_paint_us % 1000),
+         selection_us / 1000,
+         (int)(selection_us % 1000),
+         bench_runs_median(runs, runs_size, offsetof(bench_run_t, round_trips)),
+         bench_runs_median(runs, runs_size, offsetof(bench_run_t, requests)),
+         bench_runs_median(
+           runs, runs_size, offsetof(bench_run_t, peak_pixmap_bytes)),
+         bench_runs_median(runs, runs_size, offsetof(bench_run_t, heap_allocs)),
+         bench_runs_median(
+           runs, runs_size, offsetof(bench_run_t, live_resources)),
+         failures);
+  fflush(stdout);
+}
+
+// -- program
+
+int
+main(int argc, char** argv)
+{
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s SELECTOR [WINDOWS...]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  char* selector = argv[1];
+  int sizes_size = argc > 2 ? argc - 2 : DEFAULT_WINDOWS_SIZE;
+  int* sizes = calloc(sizes_size, sizeof(int));
+  for (int i = 0; i < sizes_size; i++) {
+    sizes[i] = argc > 2 ? atoi(argv[i + 2]) : DEFAULT_WINDOWS[i];
+    if (sizes[i] < 1)
+      bench_die("invalid number of windows: %s\n", argv[i + 2]);
+  }
+
+  bench_server_t server;
+  bench_server_start(&server);
+  char history[128];
+  snprintf(history,
+           sizeof(history),
+           "%s/x-window-selector-history",
+           server.state_home);
+  bench_run_t* runs = calloc(RUNS, sizeof(bench_run_t));
+
+  for (int i = 0; i < sizes_size; i++) {
+    xcb_window_t* windows = bench_windows_create(&server, sizes[i]);
+    for (int r = 0; r < RUNS; r++) {
+      bench_run(&server, selector, windows, sizes[i], &(runs[r]));
+      // every run should start with the same labels
+      unlink(history);
+    }
+    bench_windows_destroy(&server, windows, sizes[i]);
+    bench_report(sizes[i], runs, RUNS);
+  }
+
+  free(runs);
+  free(sizes);
+  bench_server_stop(&server);
+  return EXIT_SUCCESS;
+}
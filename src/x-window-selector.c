@@ -15,23 +15,36 @@ specific language governing permissions and limitations under the License.
 
 #include <argp.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <ft2build.h>
 #include <inttypes.h>
 #include <math.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ipc.h>
+#include <sys/mman.h>
+#include <sys/shm.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <sysexits.h>
 #include <time.h>
 #include <unistd.h>
+#include <xcb/randr.h>
 #include <xcb/render.h>
+#include <xcb/shape.h>
+#include <xcb/shm.h>
 #include <xcb/xcb.h>
 #include <xcb/xcb_ewmh.h>
 #include <xcb/xcb_icccm.h>
 #include <xcb/xcb_keysyms.h>
 #include <xcb/xcb_renderutil.h>
+#include <xcb/xcbext.h>
 #include FT_FREETYPE_H
 #include "helper.h"
 
@@ -48,31 +61,328 @@ typedef struct keysyms_lookup_t
 } keysyms_lookup_t;
 
 /**
- * A recursive structure holding data about windows, used to track the windows
- * we care about.  Exactly one of `window` (paired with `overlay_*`) and
- * `children` is non-NULL.
+ * A named point of a rectangle that labels can be placed at.
  *
- * ?overlay_window: the window we created over the top of the tracked window
- * ?overlay_font_gc: for drawing the text on `overlay_window`
- * ?overlay_bg_gc: for drawing the background on `overlay_window`
- * ?overlay_rect: the on-screen area covered by `overlay_window`
- * ?window: the pre-existing tracked window
+ * name: as given to the `--anchor` option
+ * x, y: position on each axis: 0 for the start, 1 for the middle, 2 for the end
+ */
+typedef struct anchor_lookup_t
+{
+  char* name;
+  int x;
+  int y;
+} anchor_lookup_t;
+
+/**
+ * A node in a tree holding data about windows, used to track the windows we
+ * care about.  All nodes live in a single array (see `wsetup_arena_t`), and
+ * children are referred to by index into it.  Exactly one of `window` (paired
+ * with `overlay_*`) and `children` is set; unset resource IDs are `XCB_NONE`.
+ *
+ * overlay_window: the window we created over the top of the tracked window
+ * overlay_font_gc: for drawing the text on `overlay_window` with the core font
+ * overlay_bg_gc: for drawing the background on `overlay_window`
+ * overlay_rect: the area covered by `overlay_window`, relative to itself; in
+ *     shared overlay mode, the tracked window's area relative to the screen
+ * window: the pre-existing tracked window
  * character: the character that must be typed to select `window`, or to
- * descend into `children` ?children: the continuation of the structure
- * children_size: size of `children` (0 if `children` is NULL)
+ *     descend into `children`
+ * children: index in the arena of the first of the continuations of the
+ *     structure, which are contiguous (-1 if there are none)
+ * children_size: number of children (0 if `children` is -1)
+ * ?overlay_text: the text currently rendered on `overlay_window`
+ * overlay_damage: area of `overlay_window` exposed since it was last painted
+ *     (empty if there is none)
+ * overlay_label_pixmap: the rendered `overlay_text` (`XCB_NONE` until
+ *     rendered, and always with ARGB overlays), copied onto `overlay_window`
+ *     when painting
+ * overlay_label_picture: XRender picture for `overlay_label_pixmap`, or with
+ *     ARGB overlays, for `overlay_window` itself (`XCB_NONE` until rendered)
+ * overlay_label_rect: the area of `overlay_window` covered by
+ *     `overlay_label_pixmap`; in shared overlay mode, the area of the screen
+ *     covered by the label
+ * window_class: class name in the WM_CLASS of `window`, or NULL if there is no
+ *     window or it doesn't set one
+ * window_rect: the on-screen area of `window`
  */
 typedef struct window_setup_t
 {
-  xcb_window_t* overlay_window;
-  xcb_gcontext_t* overlay_font_gc;
-  xcb_gcontext_t* overlay_bg_gc;
-  xcb_rectangle_t* overlay_rect;
-  xcb_window_t* window;
+  xcb_window_t overlay_window;
+  xcb_gcontext_t overlay_font_gc;
+  xcb_gcontext_t overlay_bg_gc;
+  xcb_rectangle_t overlay_rect;
+  xcb_window_t window;
   char character;
-  struct window_setup_t* children;
+  int children;
   int children_size;
+  char* overlay_text;
+  xcb_rectangle_t overlay_damage;
+  xcb_pixmap_t overlay_label_pixmap;
+  xcb_render_picture_t overlay_label_picture;
+  xcb_rectangle_t overlay_label_rect;
+  char* window_class;
+  xcb_rectangle_t window_rect;
 } window_setup_t;
 
+/**
+ * Storage for every `window_setup_t` in the tree, allocated up front and freed
+ * in one go.
+ *
+ * nodes: the nodes; addresses are stable for the arena's lifetime
+ * size: number of nodes in use
+ * capacity: size of `nodes`
+ */
+typedef struct wsetup_arena_t
+{
+  window_setup_t* nodes;
+  int size;
+  int capacity;
+} wsetup_arena_t;
+
+/**
+ * An open-addressing hash table keyed by X resource IDs, using linear probing.
+ * `XCB_NONE` is never a valid resource ID, so it marks empty slots.
+ *
+ * keys: key in each slot
+ * values: value in each slot, paired with `keys`
+ * capacity: number of slots (a power of 2)
+ * size: number of occupied slots
+ */
+typedef struct xid_table_t
+{
+  uint32_t* keys;
+  void** values;
+  int capacity;
+  int size;
+} xid_table_t;
+
+/**
+ * A window chosen for tracking, along with what we need to know to cover it.
+ *
+ * window: the tracked window
+ * rect: the on-screen area covered by the window's contents
+ * window_class: class name in the window's WM_CLASS, or NULL if it doesn't set
+ *     one
+ */
+typedef struct tracked_window_t
+{
+  xcb_window_t window;
+  xcb_rectangle_t rect;
+  char* window_class;
+} tracked_window_t;
+
+/**
+ * What is known about a top-level window, or a managed window inside a window
+ * manager's frame, kept up to date from events.
+ *
+ * window: the window
+ * rect: as in `tracked_window_t`
+ * mapped: whether the window is mapped
+ * override_redirect: whether the window sets override-redirect
+ * type_normal: whether the window's EWMH type is one that gets a label
+ * hidden: whether the window's EWMH state means it gets no label
+ * desktop: the window's EWMH desktop, or `ALL_DESKTOPS`
+ * window_class: as in `tracked_window_t`
+ * dirty: whether the window is new, or was mapped, since it was last read from
+ *     the X server, in which case the other fields may be out of date
+ * below, above: neighbouring windows in the stacking order (NULL at the bottom
+ *     and top, and for windows inside a frame)
+ * in_frame: whether the window is a managed window that isn't a child of the
+ *     root window, so it isn't in the stacking order
+ * parent: for windows inside a frame, the window's parent
+ * frame: for windows inside a frame, the top-level window containing it
+ *     (`XCB_NONE` until found)
+ * offset: for windows inside a frame, the position of `rect` relative to the
+ *     `rect` of `frame`
+ * framed: for top-level windows, the managed window inside it (`XCB_NONE` if
+ *     there isn't one)
+ */
+typedef struct live_window_t
+{
+  xcb_window_t window;
+  xcb_rectangle_t rect;
+  int mapped;
+  int override_redirect;
+  int type_normal;
+  int hidden;
+  uint32_t desktop;
+  char* window_class;
+  int dirty;
+  struct live_window_t* below;
+  struct live_window_t* above;
+  int in_frame;
+  xcb_window_t parent;
+  xcb_window_t frame;
+  xcb_point_t offset;
+  xcb_window_t framed;
+} live_window_t;
+
+/**
+ * Every top-level window, and the windows managed by the window manager, kept
+ * up to date from events on the root window and on managed windows inside
+ * frames, so the windows to track can be found without asking the X server.
+ *
+ * bottom, top: ends of the list of top-level windows in stacking order
+ * index: maps each window in the list, and each managed window inside a frame,
+ *     to its `live_window_t`, so that events are handled without searching
+ * size: number of windows in the list
+ * managed: windows managed by the window manager, or NULL if it doesn't define
+ *     them
+ * managed_list: `managed` in the window manager's order
+ * managed_list_size: size of `managed_list`
+ * managed_dirty: whether `managed` may be out of date
+ * desktop_dirty: whether the current desktop may have changed
+ * stale: whether anything may be out of date, so that the table should be
+ *     refreshed before it's next used
+ */
+typedef struct live_windows_t
+{
+  live_window_t* bottom;
+  live_window_t* top;
+  xid_table_t* index;
+  int size;
+  xid_table_t* managed;
+  xcb_window_t* managed_list;
+  int managed_list_size;
+  int managed_dirty;
+  int desktop_dirty;
+  int stale;
+} live_windows_t;
+
+/**
+ * How often windows of one class have been chosen.
+ *
+ * window_class: class name in the WM_CLASS of the windows
+ * count: number of times a window of the class has been chosen
+ */
+typedef struct history_entry_t
+{
+  char* window_class;
+  int count;
+} history_entry_t;
+
+/**
+ * How often windows of each class have been chosen, saved between runs so that
+ * frequently chosen windows can be given shorter labels.
+ *
+ * path: file the history is saved in
+ * entries: one for each class, sorted by class
+ * size: size of `entries`
+ */
+typedef struct history_t
+{
+  char* path;
+  history_entry_t* entries;
+  int size;
+} history_t;
+
+/**
+ * A node in the prefix-free code built by `label_tree_build`, before it's
+ * turned into `window_setup_t` structures.  Padding nodes have no window and no
+ * children.
+ *
+ * weight: sum of the weights of the windows below this node
+ * window: index of the window for a leaf node, else -1
+ * children: index in `label_tree_t.children` of the first child
+ * children_size: number of children, 0 for a leaf or padding node
+ */
+typedef struct label_node_t
+{
+  int64_t weight;
+  int window;
+  int children;
+  int children_size;
+} label_node_t;
+
+/**
+ * The prefix-free code built by `label_tree_build`.
+ *
+ * nodes: leaves sorted by weight, followed by internal nodes in the order they
+ *     were built
+ * size: number of nodes
+ * children: node indices of the children of every internal node, with each
+ *     node's children contiguous
+ * root: index of the root node, -1 if there are no windows
+ */
+typedef struct label_tree_t
+{
+  label_node_t* nodes;
+  int size;
+  int* children;
+  int root;
+} label_tree_t;
+
+/**
+ * Time spent and X server round trips made in each phase of the program, for
+ * the `--timings` option.
+ *
+ * line: the phases measured so far, formatted for output
+ * line_size: length of `line`
+ * phase_start: time the current phase started, in microseconds
+ * round_trips: round trips made since the program started
+ * phase_round_trips: value of `round_trips` when the current phase started
+ * total_us: time spent in the phases in `line`, in microseconds
+ * total_round_trips: round trips made in the phases in `line`
+ * synced: sequence number of the latest request known to have been answered
+ * printed: sequence number of the request made by the last output
+ */
+typedef struct timings_t
+{
+  char line[1024];
+  int line_size;
+  int64_t phase_start;
+  int round_trips;
+  int phase_round_trips;
+  int64_t total_us;
+  int total_round_trips;
+  unsigned int synced;
+  unsigned int printed;
+} timings_t;
+
+/**
+ * Counts for one subsystem's heap usage, one kind of X server resource, or one
+ * kind of request.
+ *
+ * name: the subsystem, kind of resource, or function sending the request
+ * created: heap blocks allocated, resources created, or requests sent
+ * freed: heap blocks, or resources, freed (0 for requests)
+ * bytes: total size of the heap blocks allocated (0 otherwise)
+ */
+typedef struct stats_count_t
+{
+  char* name;
+  int64_t created;
+  int64_t freed;
+  int64_t bytes;
+} stats_count_t;
+
+/**
+ * Heap and X server usage of the program, for the `--stats` option.  Only heap
+ * blocks and resources the program itself allocates are counted, not those of
+ * the libraries it uses.
+ *
+ * enabled: whether `--stats` is given
+ * heap: heap usage of each subsystem since the program started
+ * heap_size: size of `heap`
+ * resources: resources of each kind used since the program started
+ * resources_size: size of `resources`
+ * requests: requests sent from each of the program's call sites since the last
+ *     output, by the libxcb function sending them
+ * requests_size: size of `requests`
+ * printed: sequence number of the request made by the last output
+ */
+typedef struct stats_t
+{
+  int enabled;
+  stats_count_t heap[64];
+  int heap_size;
+  stats_count_t resources[64];
+  int resources_size;
+  stats_count_t requests[64];
+  int requests_size;
+  unsigned int printed;
+} stats_t;
+
 /**
  * Data generated from initial user input to the program.
  *
@@ -80,6 +390,23 @@ typedef struct window_setup_t
  * blacklist: windows which should be ignored
  * whitelist: windows which should be included
  * format: FORMAT_DEC or FORMAT_HEX
+ * blacklist_set, whitelist_set: `blacklist` and `whitelist` as sets, for
+ *     fast lookup
+ * shared_overlay: whether to draw every label on a shared overlay window
+ *     instead of creating a window per tracked window
+ * daemon: whether to stay running and choose a window whenever a client asks
+ *     through `socket_path`
+ * trigger: whether to ask a running daemon to choose a window instead of
+ *     choosing one directly
+ * socket_path: path of the daemon's Unix socket
+ * label_overlays: whether overlay windows cover just their label instead of the
+ *     whole tracked window
+ * anchor: where labels are placed on tracked windows
+ * timings: whether to print the time taken by each phase to stderr
+ * multi: whether to keep choosing windows until Enter or Escape is pressed,
+ *     printing each one as soon as it's chosen
+ * stats: whether to print heap usage, requests sent and server resources used
+ *     to stderr
  */
 typedef struct xcw_input_t
 {
@@ -92,8 +419,317 @@ typedef struct xcw_input_t
   short format;
   int font_size;
   char* font_path;
+  xid_table_t* blacklist_set;
+  xid_table_t* whitelist_set;
+  int shared_overlay;
+  int daemon;
+  int trigger;
+  char* socket_path;
+  int label_overlays;
+  anchor_lookup_t* anchor;
+  int timings;
+  int multi;
+  int stats;
 } xcw_input_t;
 
+/**
+ * Layout metrics of a single glyph, in pixels.
+ *
+ * codepoint: the character the glyph renders
+ * left: distance from the pen position to the left edge of the glyph's image
+ * width: width of the glyph's image
+ * advance: distance the pen moves after drawing the glyph
+ * ascent: distance from the baseline to the top of the glyph's image
+ * descent: distance from the baseline to the bottom of the glyph's image
+ * atlas_y: row of the glyph cache's atlas where the glyph's image starts, if
+ *     it has an atlas
+ */
+typedef struct glyph_metrics_t
+{
+  FcChar32 codepoint;
+  int left;
+  int width;
+  int advance;
+  int ascent;
+  int descent;
+  int atlas_y;
+} glyph_metrics_t;
+
+/**
+ * Glyph images rasterised by FreeType, laid out ready to upload to the X
+ * server.
+ *
+ * size: number of glyphs
+ * ids: glyph ID of each glyph (its codepoint)
+ * infos: image geometry of each glyph, paired with `ids`
+ * metrics: layout metrics of each glyph, paired with `ids`
+ * offsets: byte offset of each glyph's image in `data`, paired with `ids`
+ * data: every glyph's image, one after another, with rows padded to 4 bytes
+ * data_size: used size of `data` in bytes
+ * mapping: the glyph file `ids`, `infos`, `offsets` and `data` point into, if
+ *     they were loaded from one (NULL otherwise)
+ * mapping_size: size of `mapping` in bytes
+ */
+typedef struct glyph_raster_t
+{
+  int size;
+  uint32_t* ids;
+  xcb_render_glyphinfo_t* infos;
+  glyph_metrics_t* metrics;
+  int* offsets;
+  uint8_t* data;
+  int data_size;
+  void* mapping;
+  size_t mapping_size;
+} glyph_raster_t;
+
+/**
+ * Start of a glyph file, which saves a `glyph_raster_t` for later runs.  It's
+ * followed by the font path (padded to 4 bytes), then `ids`, `infos`,
+ * `metrics`, `offsets` and `data` of the raster.  The rest of the fields
+ * identify the glyphs it holds, with the codepoints being `ids`.
+ *
+ * magic: `GLYPH_FILE_MAGIC`
+ * font_mtime_sec, font_mtime_nsec: modification time of the font file
+ * font_file_size: size of the font file in bytes
+ * font_size: size the glyphs were rasterised at
+ * dpi: resolution the glyphs were rasterised at
+ * path_size: length of the font path
+ * size: number of glyphs
+ * data_size: size of the glyph images in bytes
+ */
+typedef struct glyph_file_header_t
+{
+  char magic[8];
+  int64_t font_mtime_sec;
+  int64_t font_mtime_nsec;
+  int64_t font_file_size;
+  int32_t font_size;
+  int32_t dpi;
+  int32_t path_size;
+  int32_t size;
+  int32_t data_size;
+  int32_t padding;
+} glyph_file_header_t;
+
+/**
+ * Faces opened for fallback fonts while rasterising glyphs the main font
+ * doesn't have.
+ *
+ * paths: font file of each face
+ * faces: the faces, paired with `paths`
+ * size: size of `faces`
+ */
+typedef struct fallback_faces_t
+{
+  char** paths;
+  FT_Face* faces;
+  int size;
+} fallback_faces_t;
+
+/**
+ * The glyphs of a glyph cache that hasn't been uploaded yet, either loaded
+ * from the glyph file or being rasterised in the background.
+ *
+ * font_stat: `stat` of the font file
+ * file_path: the glyph file
+ * saved: whether there's somewhere to save glyphs (if not, `file_path` is
+ *     unset)
+ * loaded: whether `raster` was loaded from the glyph file, rather than by
+ *     `thread`
+ * codepoints: codepoints of the glyphs
+ * thread: the thread rasterising the glyphs with its own FreeType instance
+ *     (unset if `loaded`)
+ * font_path: font file to rasterise the glyphs from
+ * font_size: size to rasterise the glyphs at
+ * error: why rasterising failed, for the main thread to report (empty if it
+ *     didn't)
+ * raster: the glyphs, once they're loaded or rasterised
+ */
+typedef struct glyph_job_t
+{
+  struct stat font_stat;
+  char file_path[4096];
+  int saved;
+  int loaded;
+  struct utf_holder codepoints;
+  pthread_t thread;
+  char* font_path;
+  int font_size;
+  char error[256];
+  glyph_raster_t raster;
+} glyph_job_t;
+
+/**
+ * Glyphs for every character that can appear in a label, rasterised once and
+ * kept on the X server for the lifetime of the program.
+ *
+ * font_path: font file the glyphs were loaded from
+ * font_size: size the glyphs were rasterised at
+ * glyphset: server-side glyphset holding every character of the pool, with
+ *     glyph IDs equal to codepoints (`XCB_NONE` if `atlas` is used instead)
+ * atlas: A8 picture holding the image of every character of the pool, one
+ *     below another, used when the images were uploaded through MIT-SHM
+ *     (`XCB_NONE` otherwise)
+ * metrics: metrics of every glyph in the cache, sorted by codepoint
+ * metrics_size: size of `metrics`
+ * ascent, descent: largest ascent and descent of any glyph in the cache, so
+ *     that all labels share a baseline
+ * job: how the glyphs are being loaded, until `glyph_cache_finish` uploads
+ *     them (NULL after)
+ */
+typedef struct glyph_cache_t
+{
+  char* font_path;
+  int font_size;
+  xcb_render_glyphset_t glyphset;
+  xcb_render_picture_t atlas;
+  glyph_metrics_t* metrics;
+  int metrics_size;
+  int ascent;
+  int descent;
+  glyph_job_t* job;
+} glyph_cache_t;
+
+/**
+ * Rendering details of the X server, resolved once at startup for use by all
+ * drawing code.
+ *
+ * screen: the screen that overlays are created on
+ * version_major, version_minor: version of the Render extension
+ * argb32, a8, rgb24: standard XRender picture formats
+ * root_format: XRender picture format of the root window's visual
+ * overlay_argb: whether overlay windows use a 32-bit ARGB visual, which is only
+ *     done when a compositor is running to blend them
+ * overlay_visual: visual of overlay windows
+ * overlay_depth: depth of `overlay_visual`
+ * overlay_colormap: colormap for `overlay_visual` (`XCB_COPY_FROM_PARENT` for
+ *     the root visual)
+ * overlay_format: XRender picture format of `overlay_visual`
+ * overlay_bg: background colour of overlay windows, 8 bits per channel with
+ *     alpha in the highest byte
+ */
+typedef struct render_context_t
+{
+  xcb_screen_t* screen;
+  uint32_t version_major;
+  uint32_t version_minor;
+  xcb_render_pictformat_t argb32;
+  xcb_render_pictformat_t a8;
+  xcb_render_pictformat_t rgb24;
+  xcb_render_pictformat_t root_format;
+  int overlay_argb;
+  xcb_visualid_t overlay_visual;
+  uint8_t overlay_depth;
+  xcb_colormap_t overlay_colormap;
+  xcb_render_pictformat_t overlay_format;
+  uint32_t overlay_bg;
+} render_context_t;
+
+/**
+ * Names of recent reply-less requests, by sequence number, so that errors
+ * delivered later through the event loop can say which request failed.  Older
+ * entries are overwritten once `REQUEST_LOG_SIZE` requests have been logged.
+ *
+ * sequences: sequence number of each logged request
+ * names: name of each logged request
+ * next: index in the arrays the next request is logged at
+ */
+typedef struct request_log_t
+{
+  unsigned int* sequences;
+  char** names;
+  int next;
+} request_log_t;
+
+/**
+ * A window covering part of the screen, on which the labels of every tracked
+ * window in that area are drawn.  The window is shaped to cover only the
+ * labels.
+ *
+ * window: the overlay window
+ * rect: the on-screen area covered by `window`
+ * picture: XRender picture for `window`
+ * font_gc: for drawing text on `window` with the core font (`XCB_NONE` if
+ *     FreeType is used)
+ */
+typedef struct shared_overlay_t
+{
+  xcb_window_t window;
+  xcb_rectangle_t rect;
+  xcb_render_picture_t picture;
+  xcb_gcontext_t font_gc;
+} shared_overlay_t;
+
+/**
+ * What an EWMH atom means for classifying windows, as a combination of the
+ * `ATOM_*` flags.
+ */
+typedef struct atom_bits_t
+{
+  xcb_atom_t atom;
+  uint32_t bits;
+} atom_bits_t;
+
+/**
+ * Requests made for a window by `window_query`.
+ *
+ * attributes: the window's attributes
+ * type: the window's _NET_WM_WINDOW_TYPE list
+ * wm_state: the window's _NET_WM_STATE list
+ * desktop: the window's _NET_WM_DESKTOP
+ */
+typedef struct window_query_t
+{
+  xcb_get_window_attributes_cookie_t attributes;
+  xcb_get_property_cookie_t type;
+  xcb_get_property_cookie_t wm_state;
+  xcb_get_property_cookie_t desktop;
+} window_query_t;
+
+/**
+ * What is needed to decide whether a window gets a label, other than its
+ * location.
+ *
+ * exists: whether the window still exists; if not, the other fields are unset
+ * map_state: the window's map state
+ * override_redirect: whether the window sets override-redirect
+ * type_normal: as in `live_window_t`
+ * hidden: as in `live_window_t`
+ * desktop: as in `live_window_t`
+ */
+typedef struct window_info_t
+{
+  int exists;
+  int map_state;
+  int override_redirect;
+  int type_normal;
+  int hidden;
+  uint32_t desktop;
+} window_info_t;
+
+/**
+ * Progress of acquiring the keyboard grab for a session.  The grab is requested
+ * without waiting for the reply, and is retried with increasing delays while
+ * another client holds it.
+ *
+ * pending: whether the reply to `cookie` hasn't been handled yet
+ * cookie: the most recent grab request
+ * grabbed: whether the keyboard is grabbed
+ * started: time the first request was made, in milliseconds
+ * retry_at: time to make the next request, in milliseconds (-1 if none is due)
+ * delay: time to wait before the request after the next one, in milliseconds
+ */
+typedef struct keyboard_grab_t
+{
+  int pending;
+  xcb_grab_keyboard_cookie_t cookie;
+  int grabbed;
+  int64_t started;
+  int64_t retry_at;
+  int delay;
+} keyboard_grab_t;
+
 /**
  * Collection of data needed throughout the runtime of the program.
  *
@@ -101,9 +737,37 @@ typedef struct xcw_input_t
  * xroot: the root window
  * ewmh: the state for `xcb_ewmh`
  * ksymbols: cached key symbols
- * overlay_font: font used to render text on overlays
+ * render: rendering details of the X server
+ * overlay_font: core font used to render text on overlays when no font file
+ *     is given (`XCB_NONE` otherwise)
+ * overlay_font_info: metrics of `overlay_font` (NULL if it isn't open)
  * input: data generated from initial user input to the program
- * wsetups: array of setup structures
+ * glyphs: glyph cache for label text (NULL until `glyph_cache_initialise`)
+ * wsetup_arena: storage for every setup structure
+ * wsetups: array of setup structures at the current level, in `wsetup_arena`
+ * overlays: maps each overlay window to the `window_setup_t` containing it
+ * fg_pen: XRender picture filled with the text colour
+ * shared_overlays: overlay windows used in shared overlay mode
+ * requests: reply-less requests whose errors are reported by the event loop
+ * listen_fd: daemon socket accepting clients (-1 if not running as a daemon)
+ * client_fd: connection to the client the current session chooses a window for
+ *     (-1 if not running as a daemon, or no session is active)
+ * live: windows kept up to date in daemon mode (NULL otherwise)
+ * history: how often windows of each class have been chosen
+ * keycode_ksl: for each keycode, the index in `input->ksl` of the character it
+ *     types, `KEYCODE_END` if it ends a `--multi` session, or -1 otherwise
+ * monitors: on-screen area of each monitor
+ * monitors_size: size of `monitors`
+ * grab: progress of acquiring the keyboard grab
+ * atom_bits: what each EWMH atom used to classify windows means, sorted by atom
+ * atom_bits_size: size of `atom_bits`
+ * current_desktop: the EWMH current desktop, or `ALL_DESKTOPS` if the window
+ *     manager doesn't say
+ * pending_glyphs: glyph cache started by `glyph_cache_start` and not yet
+ *     finished (NULL if there isn't one)
+ * root_wsetups: array of setup structures at the top level, in `wsetup_arena`
+ * root_wsetups_size: size of `root_wsetups`
+ * chosen: number of windows chosen so far in the current session
  */
 typedef struct xcw_state_t
 {
@@ -111,10 +775,34 @@ typedef struct xcw_state_t
   xcb_window_t xroot;
   xcb_ewmh_connection_t ewmh;
   xcb_key_symbols_t* ksymbols;
+  render_context_t render;
   xcb_font_t overlay_font;
+  xcb_query_font_reply_t* overlay_font_info;
   xcw_input_t* input;
+  glyph_cache_t* glyphs;
+  wsetup_arena_t wsetup_arena;
   window_setup_t* wsetups;
   int wsetups_size;
+  xid_table_t* overlays;
+  xcb_render_picture_t fg_pen;
+  shared_overlay_t* shared_overlays;
+  int shared_overlays_size;
+  request_log_t requests;
+  int listen_fd;
+  int client_fd;
+  live_windows_t* live;
+  history_t history;
+  int* keycode_ksl;
+  xcb_rectangle_t* monitors;
+  int monitors_size;
+  keyboard_grab_t grab;
+  atom_bits_t* atom_bits;
+  int atom_bits_size;
+  uint32_t current_desktop;
+  glyph_cache_t* pending_glyphs;
+  window_setup_t* root_wsetups;
+  int root_wsetups_size;
+  int chosen;
 } xcw_state_t;
 
 // -- constants
@@ -131,14 +819,115 @@ char* OVERLAY_FONT_NAME = "fixed";
  * Background colour for overlay windows.
  */
 int BG_COLOUR = 0xff333333;
+/**
+ * Background colour for overlay windows when a compositor is running.
+ */
+int TRANSLUCENT_BG_COLOUR = 0xc0333333;
 /**
  * Window class set on overlay windows.
  */
 char* OVERLAY_WINDOW_CLASS = "overlay\0xorg-choose-window";
 /**
- * Number of windows requested from _NET_CLIENT_LIST.
+ * Number of windows requested by the first read of _NET_CLIENT_LIST.  Any more
+ * are fetched with a second read.
  */
 int MAX_WINDOWS = 1024;
+/**
+ * Most atoms read from a window's _NET_WM_WINDOW_TYPE or _NET_WM_STATE.
+ */
+int MAX_PROPERTY_ATOMS = 64;
+/**
+ * Value of _NET_WM_DESKTOP for windows shown on every desktop.
+ */
+uint32_t ALL_DESKTOPS = 0xffffffff;
+/*
+ * Flags in `atom_bits_t`.
+ */
+// a window type that gets a label
+uint32_t ATOM_TYPE_NORMAL = 1 << 0;
+// a window type that doesn't get a label
+uint32_t ATOM_TYPE_OTHER = 1 << 1;
+// a window state that means the window doesn't get a label
+uint32_t ATOM_STATE_HIDDEN = 1 << 2;
+/**
+ * Subsystems heap usage is counted by for `--stats`.
+ */
+char* HEAP_TABLES = "tables";
+char* HEAP_HISTORY = "history";
+char* HEAP_GLYPHS = "glyphs";
+char* HEAP_WINDOWS = "windows";
+char* HEAP_LABELS = "labels";
+char* HEAP_OTHER = "other";
+/**
+ * Kinds of X server resource counted by `--stats`.  Resources are counted when
+ * they're created and freed by the program, not when the server frees them on
+ * exit.
+ */
+char* RESOURCE_WINDOW = "window";
+char* RESOURCE_PIXMAP = "pixmap";
+char* RESOURCE_GC = "gc";
+char* RESOURCE_FONT = "font";
+char* RESOURCE_COLORMAP = "colormap";
+char* RESOURCE_PICTURE = "picture";
+char* RESOURCE_GLYPHSET = "glyphset";
+char* RESOURCE_SHM_SEGMENT = "shm_segment";
+/**
+ * Most subsystems, kinds of resource, and kinds of request counted by
+ * `--stats`.
+ */
+int STATS_COUNTS_SIZE = 64;
+/**
+ * Number of possible keycodes.
+ */
+int KEYCODES_SIZE = 256;
+/**
+ * Keys that end a `--multi` session: Return, KP_Enter and Escape.
+ */
+xcb_keysym_t END_KEYSYMS[] = { 0xff0d, 0xff8d, 0xff1b };
+int END_KEYSYMS_SIZE = sizeof(END_KEYSYMS) / sizeof(END_KEYSYMS[0]);
+/**
+ * Value in `keycode_ksl` for keys in `END_KEYSYMS`.
+ */
+int KEYCODE_END = -2;
+/**
+ * Number of recent requests kept in a `request_log_t`.
+ */
+int REQUEST_LOG_SIZE = 4096;
+/**
+ * Name of the daemon's socket within `$XDG_RUNTIME_DIR`.
+ */
+char* SOCKET_NAME = "x-window-selector.sock";
+/**
+ * Longest line sent over the daemon socket, including the newline.
+ */
+int SOCKET_LINE_SIZE = 64;
+/**
+ * Time in milliseconds the daemon waits for events to stop arriving before
+ * reading what changed into its live window table.
+ */
+int LIVE_REFRESH_DELAY = 50;
+/**
+ * Deepest a managed window is looked for inside its window manager's frame.
+ */
+int MAX_FRAME_DEPTH = 8;
+/**
+ * Name of the file the selection history is saved in, within the XDG state
+ * directory.
+ */
+char* HISTORY_NAME = "x-window-selector-history";
+/**
+ * Name of the file rasterised glyphs are saved in, within the XDG cache
+ * directory.  It's followed by a hash of the font and characters.
+ */
+char* GLYPH_FILE_NAME = "x-window-selector-glyphs";
+/**
+ * Identifies a glyph file, and the version of its layout.
+ */
+char* GLYPH_FILE_MAGIC = "XWSGLY01";
+/**
+ * Resolution labels are rasterised at, in dots per inch.
+ */
+int FONT_DPI = 90;
 /**
  * Printed version string (used internally by `argp`).
  */
@@ -149,6 +938,45 @@ const char* argp_program_version = "xorg-choose-window 0.2.0-next";
 short FORMAT_DEC = 0;
 short FORMAT_HEX = 1;
 
+/**
+ * Places labels can be anchored at.  The first is the default.
+ */
+anchor_lookup_t ALL_ANCHORS[] = {
+  { "centre", 1, 1 },         { "center", 1, 1 },     { "top-left", 0, 0 },
+  { "top", 1, 0 },            { "top-right", 2, 0 },  { "left", 0, 1 },
+  { "right", 2, 1 },          { "bottom-left", 0, 2 }, { "bottom", 1, 2 },
+  { "bottom-right", 2, 2 }
+};
+/**
+ * Size of `ALL_ANCHORS`.
+ */
+int ALL_ANCHORS_SIZE = (sizeof(ALL_ANCHORS) / sizeof(*ALL_ANCHORS));
+/**
+ * Space around the text of a label, in pixels, when overlay windows cover just
+ * their label.
+ */
+int LABEL_PADDING = 4;
+/**
+ * Longest time to keep retrying the keyboard grab while another client holds
+ * it, in milliseconds.
+ */
+int GRAB_TIMEOUT = 1000;
+/**
+ * Delay before retrying the keyboard grab the first time, in milliseconds.
+ * Each retry waits twice as long as the last, up to `GRAB_MAX_DELAY`.
+ */
+int GRAB_FIRST_DELAY = 1;
+/**
+ * Longest delay between retries of the keyboard grab, in milliseconds.
+ */
+int GRAB_MAX_DELAY = 64;
+/**
+ * Glyph images taking up at least this many bytes are uploaded through MIT-SHM
+ * when the X server can share memory with us.  Smaller ones are sent over the
+ * connection to a glyphset, which draws text in fewer requests.
+ */
+int SHM_UPLOAD_MIN_BYTES = 65536;
+
 /**
  * Keysyms with an obvious 1-character representation.  Only these characters
  * may be used as input.
@@ -190,6 +1018,104 @@ max(int a, int b)
   return a < b ? b : a;
 }
 
+/**
+ * Read the monotonic clock.
+ *
+ * returns: time in microseconds from an arbitrary starting point
+ */
+int64_t
+monotonic_us()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * Read the monotonic clock.
+ *
+ * returns: time in milliseconds from an arbitrary starting point
+ */
+int64_t
+monotonic_ms()
+{
+  return monotonic_us() / 1000;
+}
+
+/**
+ * Extend a rectangle to also cover another rectangle.
+ *
+ * dest: rectangle to extend; if empty, it's replaced by `src`
+ */
+void
+rect_union(xcb_rectangle_t* dest, xcb_rectangle_t* src)
+{
+  if (dest->width == 0 || dest->height == 0) {
+    *dest = *src;
+    return;
+  }
+  int x1 = min(dest->x, src->x);
+  int y1 = min(dest->y, src->y);
+  int x2 = max(dest->x + dest->width, src->x + src->width);
+  int y2 = max(dest->y + dest->height, src->y + src->height);
+  xcb_rectangle_t result = { x1, y1, x2 - x1, y2 - y1 };
+  *dest = result;
+}
+
+/**
+ * Compute the overlap of two rectangles.
+ *
+ * result (output): the overlap, unset if there is none
+ *
+ * returns: whether the rectangles overlap
+ */
+int
+rect_intersect(xcb_rectangle_t* a, xcb_rectangle_t* b, xcb_rectangle_t* result)
+{
+  int x1 = max(a->x, b->x);
+  int y1 = max(a->y, b->y);
+  int x2 = min(a->x + a->width, b->x + b->width);
+  int y2 = min(a->y + a->height, b->y + b->height);
+  if (x2 <= x1 || y2 <= y1)
+    return 0;
+  xcb_rectangle_t overlap = { x1, y1, x2 - x1, y2 - y1 };
+  *result = overlap;
+  return 1;
+}
+
+/**
+ * Multiply the colour channels of a colour by its alpha, as XRender and ARGB
+ * visuals expect.  Opaque colours are unchanged.
+ *
+ * argb: 8 bits per channel, alpha in the highest byte
+ */
+uint32_t
+argb_premultiply(uint32_t argb)
+{
+  uint32_t alpha = argb >> 24;
+  uint32_t result = alpha << 24;
+  for (int shift = 0; shift < 24; shift += 8)
+    result |= (((argb >> shift) & 0xff) * alpha / 0xff) << shift;
+  return result;
+}
+
+/**
+ * Convert a colour to the form used by XRender.
+ *
+ * argb: 8 bits per channel, alpha in the highest byte
+ */
+xcb_render_color_t
+render_colour(uint32_t argb)
+{
+  argb = argb_premultiply(argb);
+  // scale each channel from 8 to 16 bits
+  xcb_render_color_t colour = { ((argb >> 16) & 0xff) * 0x101,
+                                ((argb >> 8) & 0xff) * 0x101,
+                                (argb & 0xff) * 0x101,
+                                ((argb >> 24) & 0xff) * 0x101 };
+  return colour;
+}
+
 /**
  * Print an error message to stderr and exit the process with the given status.
  *
@@ -252,1103 +1178,5185 @@ xcw_exit_no_match()
   exit(0);
 }
 
+/**
+ * Format a window ID for output, according to the output format option.
+ *
+ * buffer (output): null-terminated result, including a trailing newline
+ * size: size of `buffer`
+ */
+void
+format_window(xcw_input_t* input, xcb_window_t window, char* buffer, int size)
+{
+  if (input->format == FORMAT_HEX)
+    snprintf(buffer, size, "0x%x\n", window);
+  else
+    snprintf(buffer, size, "%d\n", window);
+}
+
 /**
  * Print the chosen window to stdout and exit the process.
  */
 void
 choose_window(xcw_input_t* input, xcb_window_t window)
 {
-  if (input->format == FORMAT_DEC)
-    printf("%d\n", window);
-  else if (input->format == FORMAT_HEX)
-    printf("0x%x\n", window);
+  char line[SOCKET_LINE_SIZE];
+  format_window(input, window, line, sizeof(line));
+  fputs(line, stdout);
   xcw_exit_match();
 }
 
-// -- xorg utilities
-
 /**
- * Perform the check for a checked, reply-less xcb request.
+ * Create the directory a file is in, and any missing parents, like `mkdir -p`.
+ * Directories are only readable by the user, as they hold per-user state.
  *
- * cookie: corresponding to the request
- * msg: to print in case of error
+ * returns: whether the directory exists now (if not, `errno` says why)
  */
-void
-xorg_check_request(xcb_connection_t* xcon, xcb_void_cookie_t cookie, char* msg)
+int
+make_parent_dirs(char* path)
 {
-  xcb_generic_error_t* error = xcb_request_check(xcon, cookie);
-  if (error)
-    xcw_die("%s (%d)\n", msg, error->error_code);
+  char dir[4096];
+  snprintf(dir, sizeof(dir), "%s", path);
+  char* slash = strrchr(dir, '/');
+  if (slash == NULL || slash == dir)
+    return 1;
+  *slash = '\0';
+  for (char* end = dir + 1;; end++) {
+    if (*end != '/' && *end != '\0')
+      continue;
+    char next = *end;
+    *end = '\0';
+    if (mkdir(dir, 0700) != 0 && errno != EEXIST)
+      return 0;
+    *end = next;
+    if (next == '\0')
+      return 1;
+  }
 }
 
+// -- stats
+
 /**
- * Move and resize a window.
- *
- * x, y: new absolute screen location
+ * Measurements for the `--stats` option.  They're only taken if the option is
+ * given, by the helpers below, which the program allocates memory and uses X
+ * server resources through.
  */
-void
-xorg_window_move_resize(
-  xcb_connection_t* xcon,
-  xcb_window_t window,
-  int x,
-  int y,
-  int w,
-  int h)
-{
-  int mask =
-    (XCB_CONFIG_WINDOW_X | XCB_CONFIG_WINDOW_Y | XCB_CONFIG_WINDOW_WIDTH |
-     XCB_CONFIG_WINDOW_HEIGHT);
-  uint32_t values[] = { x, y, w, h };
-  xcb_configure_window(xcon, window, mask, values);
-}
+stats_t STATS;
+
+/**
+ * Held while `STATS` is updated, as glyphs are rasterised in another thread.
+ */
+pthread_mutex_t STATS_LOCK = PTHREAD_MUTEX_INITIALIZER;
 
 /**
- * Determine whether a window has a property defined.
+ * Add to the counts for a name, if `--stats` is given.
  *
- * prop: property ID
+ * counts: `STATS.heap`, `STATS.resources` or `STATS.requests`
+ * counts_size: size of `counts`
  */
-int
-xorg_window_has_property(
-  xcb_connection_t* xcon,
-  xcb_window_t window,
-  xcb_atom_t prop)
+void
+stats_record(
+  stats_count_t* counts,
+  int* counts_size,
+  char* name,
+  int64_t created,
+  int64_t freed,
+  int64_t bytes)
 {
-  xcb_list_properties_cookie_t lpc = xcb_list_properties(xcon, window);
-  xcb_list_properties_reply_t* lpr;
-  if (!(lpr = xcb_list_properties_reply(xcon, lpc, NULL))) {
-    xcw_die("list_properties");
+  if (!STATS.enabled)
+    return;
+  pthread_mutex_lock(&STATS_LOCK);
+  int i = 0;
+  while (i < *counts_size && strcmp(counts[i].name, name) != 0)
+    i++;
+  if (i == *counts_size && i < STATS_COUNTS_SIZE) {
+    stats_count_t count = { name, 0, 0, 0 };
+    counts[i] = count;
+    *counts_size += 1;
   }
-
-  xcb_atom_t* props = xcb_list_properties_atoms(lpr);
-  int result = 0;
-  for (int i = 0; i < xcb_list_properties_atoms_length(lpr); i++) {
-    if (props[i] == prop) {
-      result = 1;
-      break;
-    }
+  if (i < *counts_size) {
+    counts[i].created += created;
+    counts[i].freed += freed;
+    counts[i].bytes += bytes;
   }
-
-  free(lpr);
-  return result;
+  pthread_mutex_unlock(&STATS_LOCK);
 }
 
 /**
- * Construct a 2-byte character string from a 1-byte character string.
+ * Record an X server resource being created.
+ *
+ * kind: one of the `RESOURCE_*` constants
  */
-xcb_char2b_t*
-xorg_str_to_2b(char* text, int text_size)
+void
+stats_created(char* kind)
 {
-  xcb_char2b_t* text2b = malloc(text_size * sizeof(xcb_char2b_t));
-  xcb_char2b_t c = { 0, 0 };
-  for (int i = 0; i < text_size; i++) {
-    c.byte2 = text[i];
-    text2b[i] = c;
-  }
-  return text2b;
+  stats_record(STATS.resources, &(STATS.resources_size), kind, 1, 0, 0);
 }
 
-static void
-load_glyph(
-  xcb_connection_t* c,
-  xcb_render_glyphset_t gs,
-  FT_Face face,
-  int charcode)
+/**
+ * Record an X server resource being freed.
+ *
+ * kind: one of the `RESOURCE_*` constants
+ */
+void
+stats_freed(char* kind)
 {
-  uint32_t gid;
-  xcb_render_glyphinfo_t ginfo;
-
-  FT_Select_Charmap(face, ft_encoding_unicode);
-  int glyph_index = FT_Get_Char_Index(face, charcode);
-  if (glyph_index == 0) {
-    // TODO use fallback font
-    // http://www.unicode.org/policies/lastresortfont_eula.html
-    printf("character %d not found\n", charcode);
-  }
-  FT_Load_Glyph(face, glyph_index, FT_LOAD_RENDER | FT_LOAD_FORCE_AUTOHINT);
-
-  FT_Bitmap* bitmap = &face->glyph->bitmap;
-  ginfo.x = -face->glyph->bitmap_left;
-  ginfo.y = face->glyph->bitmap_top;
-  ginfo.width = bitmap->width;
-  ginfo.height = bitmap->rows;
-  ginfo.x_off = face->glyph->advance.x / 64;
-  ginfo.y_off = face->glyph->advance.y / 64;
-
-  // glyph_id = charcode;
-
-  gid = charcode;
-
-  int stride = (ginfo.width + 3) & ~3;
-  uint8_t tmpbitmap[stride * ginfo.height];
-  int y;
-  for (y = 0; y < ginfo.height; y++)
-    memcpy(
-      tmpbitmap + y * stride, bitmap->buffer + y * ginfo.width, ginfo.width);
-
-  xcb_render_add_glyphs_checked(
-    c, gs, 1, &gid, &ginfo, stride * ginfo.height, tmpbitmap);
-
-  xcb_flush(c);
+  stats_record(STATS.resources, &(STATS.resources_size), kind, 0, 1, 0);
 }
 
-static xcb_render_picture_t
-create_pen(xcb_connection_t* c, int red, int green, int blue, int alpha)
+/**
+ * Record a request being sent by a libxcb function.
+ *
+ * function: name of the function, eg. `xcb_create_window`
+ */
+void
+stats_request(char* function)
 {
-  xcb_render_color_t color = {
-    .red = red, .green = green, .blue = blue, .alpha = alpha
-  };
-
-  xcb_render_pictforminfo_t* fmt;
-  const xcb_render_query_pict_formats_reply_t* fmt_rep =
-    xcb_render_util_query_formats(c);
-  // alpha can only be used with a picture containing a pixmap
-  fmt =
-    xcb_render_util_find_standard_format(fmt_rep, XCB_PICT_STANDARD_ARGB_32);
-
-  xcb_drawable_t root = xcb_setup_roots_iterator(xcb_get_setup(c)).data->root;
-
-  xcb_pixmap_t pm = xcb_generate_id(c);
-  xcb_create_pixmap(c, 32, pm, root, 1, 1);
-
-  uint32_t values[1];
-  values[0] = XCB_RENDER_REPEAT_NORMAL;
-
-  xcb_render_picture_t picture = xcb_generate_id(c);
-  xcb_render_create_picture(
-    c, picture, pm, fmt->id, XCB_RENDER_CP_REPEAT, values);
+  stats_record(STATS.requests, &(STATS.requests_size), function, 1, 0, 0);
+}
 
-  xcb_rectangle_t rect = { .x = 0, .y = 0, .width = 1, .height = 1 };
+/**
+ * Send a request by calling a libxcb function, counting it for `--stats`.
+ * Functions that send several requests, such as `xcb_ewmh_init_atoms`, count
+ * once.
+ *
+ * request: the libxcb function
+ */
+#define XCW_REQUEST(request, ...)                                              \
+  (stats_request(#request), request(__VA_ARGS__))
 
-  xcb_render_fill_rectangles(
-    c, XCB_RENDER_PICT_OP_OVER, picture, color, 1, &rect);
+// the program's allocator: the standard functions, counted for each
+// subsystem, which is one of the `HEAP_*` constants
 
-  xcb_free_pixmap(c, pm);
-  return picture;
+void*
+xcw_malloc(char* subsystem, size_t size)
+{
+  void* ptr = malloc(size);
+  if (ptr != NULL)
+    stats_record(STATS.heap, &(STATS.heap_size), subsystem, 1, 0, size);
+  return ptr;
 }
 
-static xcb_render_glyphset_t
-load_glyphset(
-  xcb_connection_t* c,
-  char* filename,
-  int size,
-  struct utf_holder holder)
+void*
+xcw_calloc(char* subsystem, size_t count, size_t size)
 {
-  static int ft_lib_initialized = 0;
-  static FT_Library library;
-  int n;
-
-  xcb_render_pictforminfo_t* fmt_a8;
-  const xcb_render_query_pict_formats_reply_t* fmt_rep =
-    xcb_render_util_query_formats(c);
-  fmt_a8 = xcb_render_util_find_standard_format(fmt_rep, XCB_PICT_STANDARD_A_8);
-
-  xcb_render_glyphset_t gs = xcb_generate_id(c);
-  xcb_render_create_glyph_set(c, gs, fmt_a8->id);
-
-  if (!ft_lib_initialized)
-    FT_Init_FreeType(&library);
-
-  // TODO: leave that aside from now and do a simple loading
-  FT_Face face;
-
-  FT_New_Face(library, filename, 0, &face);
+  void* ptr = calloc(count, size);
+  if (ptr != NULL)
+    stats_record(STATS.heap, &(STATS.heap_size), subsystem, 1, 0, count * size);
+  return ptr;
+}
 
-  FT_Set_Char_Size(face, 0, size * 64, 90, 90);
+/**
+ * Growing a block is counted as freeing it and allocating another.
+ */
+void*
+xcw_realloc(char* subsystem, void* ptr, size_t size)
+{
+  void* result = realloc(ptr, size);
+  // on failure, the old block is left alone
+  if (result != NULL) {
+    int64_t freed = ptr == NULL ? 0 : 1;
+    stats_record(STATS.heap, &(STATS.heap_size), subsystem, 1, freed, size);
+  }
+  return result;
+}
 
-  for (n = 0; n < holder.length; n++)
-    load_glyph(c, gs, face, holder.str[n]);
+char*
+xcw_strdup(char* subsystem, const char* str)
+{
+  char* result = strdup(str);
+  if (result != NULL) {
+    int64_t size = strlen(result) + 1;
+    stats_record(STATS.heap, &(STATS.heap_size), subsystem, 1, 0, size);
+  }
+  return result;
+}
 
-  FT_Done_Face(face);
+void
+xcw_free(char* subsystem, void* ptr)
+{
+  if (ptr != NULL)
+    stats_record(STATS.heap, &(STATS.heap_size), subsystem, 0, 1, 0);
+  free(ptr);
+}
 
-  return gs;
+/**
+ * Order counts by name, for use with `qsort`.
+ */
+int
+stats_count_compare(const void* a, const void* b)
+{
+  return strcmp(((stats_count_t*)a)->name, ((stats_count_t*)b)->name);
 }
 
 /**
- * Render text centred on a window.
+ * Print heap usage and server resources used since the program started, and
+ * requests sent since the last output, on a single line to stderr, if
+ * `--stats` is given.  The heap usage of each subsystem is printed as
+ * `<subsystem>_allocs=<blocks> <subsystem>_frees=<blocks>
+ * <subsystem>_bytes=<bytes>`, followed by totals, and each kind of resource as
+ * `<kind>_created=<count> <kind>_freed=<count>`.  `live_resources` is the
+ * number of resources created and not freed, which should stay the same
+ * between daemon sessions.
  *
- * win_rect: rectangle covering window with ID `win`
- * gc: graphics context for rendering the text
- * text: text to render
+ * Requests sent from the program's call sites are printed as
+ * `req_<function>=<count>`, named after the libxcb function without its `xcb_`
+ * prefix, which stands for one opcode.  `requests` is every request sent,
+ * including those sent inside libraries and by `--timings`, which is found by
+ * sending one more.
  */
 void
-xorg_draw_text_centred(
-  xcb_connection_t* xcon,
-  xcb_window_t win,
-  xcb_rectangle_t* win_rect,
-  xcb_gcontext_t gc,
-  char* text,
-  int font_size,
-  char* font_path)
+stats_print(xcw_input_t* input, xcb_connection_t* xcon)
 {
-  int size = min(strlen(text), 255);
-
-  // check expected rendered size
-  xcb_char2b_t* text_2b = xorg_str_to_2b(text, size);
-  xcb_query_text_extents_cookie_t qtec =
-    (xcb_query_text_extents(xcon, gc, size, text_2b));
-  free(text_2b);
-  xcb_query_text_extents_reply_t* qter;
-  if (!(qter = xcb_query_text_extents_reply(xcon, qtec, NULL))) {
-    xcw_die("query_text_extents\n");
+  if (!input->stats)
+    return;
+  pthread_mutex_lock(&STATS_LOCK);
+  fprintf(stderr, "stats:");
+  qsort(
+    STATS.heap, STATS.heap_size, sizeof(stats_count_t), stats_count_compare);
+  stats_count_t heap = { NULL, 0, 0, 0 };
+  for (int i = 0; i < STATS.heap_size; i++) {
+    stats_count_t* count = &(STATS.heap[i]);
+    fprintf(stderr,
+            " %s_allocs=%" PRId64 " %s_frees=%" PRId64 " %s_bytes=%" PRId64,
+            count->name,
+            count->created,
+            count->name,
+            count->freed,
+            count->name,
+            count->bytes);
+    heap.created += count->created;
+    heap.freed += count->freed;
+    heap.bytes += count->bytes;
   }
+  fprintf(stderr,
+          " heap_allocs=%" PRId64 " heap_frees=%" PRId64 " heap_bytes=%" PRId64
+          " heap_live=%" PRId64,
+          heap.created,
+          heap.freed,
+          heap.bytes,
+          heap.created - heap.freed);
+
+  qsort(STATS.requests,
+        STATS.requests_size,
+        sizeof(stats_count_t),
+        stats_count_compare);
+  for (int i = 0; i < STATS.requests_size; i++) {
+    stats_count_t* count = &(STATS.requests[i]);
+    fprintf(stderr,
+            " req_%s=%" PRId64,
+            count->name + strlen("xcb_"),
+            count->created);
+  }
+  STATS.requests_size = 0;
+  unsigned int sequence = xcb_no_operation(xcon).sequence;
+  fprintf(stderr, " requests=%u", sequence - STATS.printed - 1);
+  STATS.printed = sequence;
+
+  qsort(STATS.resources,
+        STATS.resources_size,
+        sizeof(stats_count_t),
+        stats_count_compare);
+  int64_t live_resources = 0;
+  for (int i = 0; i < STATS.resources_size; i++) {
+    stats_count_t* count = &(STATS.resources[i]);
+    fprintf(stderr,
+            " %s_created=%" PRId64 " %s_freed=%" PRId64,
+            count->name,
+            count->created,
+            count->name,
+            count->freed);
+    live_resources += count->created - count->freed;
+  }
+  fprintf(stderr, " live_resources=%" PRId64 "\n", live_resources);
+  pthread_mutex_unlock(&STATS_LOCK);
+}
 
-  int x = (win_rect->width - qter->overall_width) / 2;
-  int y = (win_rect->height - qter->font_ascent - qter->font_descent) / 2;
-
-  xcb_screen_t* screen;
-  screen = xcb_setup_roots_iterator(xcb_get_setup(xcon)).data;
-  xcb_pixmap_t pmap = xcb_generate_id(xcon);
-
-  xcb_create_pixmap(
-    xcon,
-    screen->root_depth,
-    pmap,
-    screen->root, // doesn't matter
-    win_rect->width,
-    win_rect->height);
-
-  xcb_render_pictforminfo_t* fmt;
-  const xcb_render_query_pict_formats_reply_t* fmt_rep =
-    xcb_render_util_query_formats(xcon);
-
-  fmt = xcb_render_util_find_standard_format(fmt_rep, XCB_PICT_STANDARD_RGB_24);
-
-  uint32_t values[2];
-  xcb_void_cookie_t cookie;
-  xcb_render_picture_t picture = xcb_generate_id(xcon);
-  values[0] = XCB_RENDER_POLY_MODE_IMPRECISE;
-  values[1] = XCB_RENDER_POLY_EDGE_SMOOTH;
-  cookie = xcb_render_create_picture_checked(
-    xcon,
-    picture, // pid
-    pmap,    // drawable
-    fmt->id, // format
-    XCB_RENDER_CP_POLY_MODE | XCB_RENDER_CP_POLY_EDGE,
-    values); // make it smooth
-
-  /*xcb_render_picture_t fg_pen = create_pen(xcon, 0xff0f, 0, 0xff00, 0xf000);*/
-  xcb_render_picture_t fg_pen =
-    create_pen(xcon, 0x0f00, 0xff00, 0x0f00, 0xf000);
-
-  char* temp = malloc(strlen(text));
-  strcpy(temp, text);
-  struct utf_holder holder;
-  holder = char_to_uint32(temp);
-  /*int font_size = max(x, y) / 100 * 30;*/
-  xcb_render_glyphset_t font =
-    load_glyphset(xcon, font_path, font_size, holder);
-  xcb_render_util_composite_text_stream_t* ts =
-    xcb_render_util_composite_text_stream(font, holder.length, 0);
-
-  // draw the text (in holder) at certain positions
-  xcb_render_util_glyphs_32(
-    ts,
-    x,             // dx
-    y,             // dy
-    holder.length, //
-    holder.str);
+// -- timings
 
-  xcb_render_util_composite_text(
-    xcon,                    // connection
-    XCB_RENDER_PICT_OP_OVER, // op
-    fg_pen,                  // src
-    picture,                 // dst
-    0,                       // fmt
-    0,                       // src x
-    0,                       // src y
-    ts);                     // txt stream
+/**
+ * Measurements for the `--timings` option.  They're always taken, as it's
+ * cheap, but only printed if the option is given.
+ */
+timings_t TIMINGS;
 
-  xcb_copy_area(
-    xcon,            /* xcb_connection_t */
-    pmap,            /* The Drawable we want to paste */
-    win,             /* The Drawable on which we copy the previous Drawable */
-    gc,              /* A Graphic Context */
-    0,               /* Top left x coordinate of the region to copy */
-    0,               /* Top left y coordinate of the region to copy */
-    0,               /* Top left x coordinate of the region where to copy */
-    0,               /* Top left y coordinate of the region where to copy */
-    win_rect->width, /* Width of the region to copy */
-    win_rect->height /* Height of the region to copy */
-  );
+/**
+ * Wait for the reply to a request, counting the round trip it costs.
+ *
+ * reply: the `xcb_*_reply` function for the request
+ */
+#define XCW_REPLY(reply, xcon, cookie, error)                                  \
+  (timings_wait((cookie).sequence), reply(xcon, cookie, error))
 
-  /*xcb_image_text_8(xcon, size, win, gc, x, y + qter->font_ascent, text);*/
+/**
+ * Start measuring.  Should be called as early as possible.
+ */
+void
+timings_initialise()
+{
+  TIMINGS.phase_start = monotonic_us();
 }
 
 /**
- * Determine whether a window is 'normal' and visible according to the base
- * Xorg specification.
+ * Record that a reply is about to be waited for.  Replies arrive in order, so
+ * waiting costs a round trip only if no later request has been answered yet:
+ * replies to requests sent in a batch are counted once.
+ *
+ * sequence: sequence number of the request
  */
-int
-xorg_window_normal(xcb_connection_t* xcon, xcb_window_t window)
+void
+timings_wait(unsigned int sequence)
 {
-  xcb_get_window_attributes_cookie_t gwac =
-    (xcb_get_window_attributes(xcon, window));
-  xcb_get_window_attributes_reply_t* gwar;
-  if (!(gwar = xcb_get_window_attributes_reply(xcon, gwac, NULL))) {
-    xcw_die("get_window_attributes\n");
+  if (sequence > TIMINGS.synced) {
+    TIMINGS.round_trips += 1;
+    TIMINGS.synced = sequence;
   }
-
-  return (
-    gwar->map_state == XCB_MAP_STATE_VIEWABLE && gwar->override_redirect == 0);
 }
 
 /**
- * Determine whether a window is a persistent application window according
- * EWMH.
+ * Record a round trip made inside a library, where the request can't be seen.
  */
-int
-ewmh_window_normal(xcw_state_t* state, xcb_window_t window)
+void
+timings_round_trip()
 {
-  xcb_get_property_cookie_t gpc = (xcb_get_property(
-    state->xcon,
-    0,
-    window,
-    state->ewmh._NET_WM_WINDOW_TYPE,
-    XCB_ATOM_ATOM,
-    0,
-    1));
-  xcb_get_property_reply_t* gpr;
-  if (!(gpr = xcb_get_property_reply(state->xcon, gpc, NULL))) {
-    xcw_die("get_property _NET_WM_WINDOW_TYPE\n");
-  }
-  uint32_t* window_type = (uint32_t*)xcb_get_property_value(gpr);
-  int prop_len = xcb_get_property_value_length(gpr);
-  free(gpr);
-
-  // if reply length is 0, window type isn't defined, so treat it as normal
-  return (
-    prop_len == 0 ||
-    window_type[0] == state->ewmh._NET_WM_WINDOW_TYPE_TOOLBAR ||
-    window_type[0] == state->ewmh._NET_WM_WINDOW_TYPE_MENU ||
-    window_type[0] == state->ewmh._NET_WM_WINDOW_TYPE_UTILITY ||
-    window_type[0] == state->ewmh._NET_WM_WINDOW_TYPE_SPLASH ||
-    window_type[0] == state->ewmh._NET_WM_WINDOW_TYPE_DIALOG ||
-    window_type[0] == state->ewmh._NET_WM_WINDOW_TYPE_NORMAL);
+  TIMINGS.round_trips += 1;
 }
 
 /**
- * Get all windows from the X server.
- *
- * windows (output): window IDs
- * windows_size (output): size of `windows`
+ * Wait for the X server to handle every request sent so far, without counting
+ * it as a round trip, so that a phase's time includes the server's work.  Does
+ * nothing unless `--timings` is given.
  */
 void
-xorg_get_windows(xcw_state_t* state, xcb_window_t** windows, int* windows_size)
+timings_sync(xcw_input_t* input, xcb_connection_t* xcon)
 {
-  xcb_query_tree_cookie_t qtc = xcb_query_tree(state->xcon, state->xroot);
-  xcb_query_tree_reply_t* qtr;
-  if (!(qtr = xcb_query_tree_reply(state->xcon, qtc, NULL))) {
-    xcw_die("query_tree\n");
-  }
-  xcb_window_t* referenced_windows = xcb_query_tree_children(qtr);
-  int size = xcb_query_tree_children_length(qtr);
-
-  // copy for easier usage
-  *windows = calloc(size, sizeof(xcb_window_t));
-  for (int i = 0; i < size; i++)
-    (*windows)[i] = referenced_windows[i];
-  free(qtr);
+  if (!input->timings)
+    return;
+  xcb_get_input_focus_cookie_t gifc = xcb_get_input_focus(xcon);
+  free(xcb_get_input_focus_reply(xcon, gifc, NULL));
+  if (gifc.sequence > TIMINGS.synced)
+    TIMINGS.synced = gifc.sequence;
+}
 
-  *windows_size = size;
+/**
+ * Start a new phase without recording the current one, eg. to skip time spent
+ * waiting for the user.
+ */
+void
+timings_skip()
+{
+  TIMINGS.phase_start = monotonic_us();
+  TIMINGS.phase_round_trips = TIMINGS.round_trips;
 }
 
 /**
- * Get windows managed by the window manager.
+ * End the current phase and start a new one.
  *
- * is_defined (output): whether the window manager defines the windows it
- *     tracks; if 0, `windows` and `windows_size` will not be set
- * windows (output): window IDs
- * windows_size (output): size of `windows`
+ * name: name of the phase that ended
  */
 void
-xorg_get_managed_windows(
-  xcw_state_t* state,
-  int* is_defined,
-  xcb_window_t** windows,
-  int* windows_size)
+timings_phase(char* name)
 {
-  *is_defined = xorg_window_has_property(
-    state->xcon, state->xroot, state->ewmh._NET_CLIENT_LIST);
-
-  if (*is_defined) {
-    xcb_get_property_cookie_t gpc = (xcb_get_property(
-      state->xcon,
-      0,
-      state->xroot,
-      state->ewmh._NET_CLIENT_LIST,
-      XCB_ATOM_WINDOW,
-      0,
-      MAX_WINDOWS));
-    xcb_get_property_reply_t* gpr;
-    if (!(gpr = xcb_get_property_reply(state->xcon, gpc, NULL))) {
-      xcw_die("get_property _NET_CLIENT_LIST\n");
-    }
-    xcb_window_t* referenced_windows =
-      ((xcb_window_t*)xcb_get_property_value(gpr));
-    // each window ID is 4 bytes
-    int size = xcb_get_property_value_length(gpr) / 4;
-
-    // copy for easier usage
-    *windows = calloc(size, sizeof(xcb_window_t));
-    for (int i = 0; i < size; i++)
-      (*windows)[i] = referenced_windows[i];
-    free(gpr);
-
-    *windows_size = size;
-  }
+  int64_t now = monotonic_us();
+  int64_t us = now - TIMINGS.phase_start;
+  int round_trips = TIMINGS.round_trips - TIMINGS.phase_round_trips;
+  int remain = sizeof(TIMINGS.line) - TIMINGS.line_size;
+  int written = snprintf(TIMINGS.line + TIMINGS.line_size,
+                         remain,
+                         " %s_ms=%" PRId64 ".%03d %s_rt=%d",
+                         name,
+                         us / 1000,
+                         (int)(us % 1000),
+                         name,
+                         round_trips);
+  TIMINGS.line_size += min(written, remain - 1);
+  TIMINGS.total_us += us;
+  TIMINGS.total_round_trips += round_trips;
+  TIMINGS.phase_start = now;
+  TIMINGS.phase_round_trips = TIMINGS.round_trips;
 }
 
 /**
- * Determine whether a window is managed by the window manager.
- *
- * managed_windows: windows that are managed by the window manager
+ * Print the phases measured since the last output on a single line to stderr,
+ * followed by their total, if `--timings` is given.  Phases are printed as
+ * `<name>_ms=<milliseconds> <name>_rt=<round trips>`.  The total includes the
+ * number of requests sent since the last output, which is found by sending one
+ * more.
  */
-int
-xorg_window_managed(
-  xcb_window_t window,
-  xcb_window_t* managed_windows,
-  int managed_windows_size)
+void
+timings_print(xcw_input_t* input, xcb_connection_t* xcon)
 {
-  int found = 0;
-  for (int i = 0; i < managed_windows_size; i++) {
-    if (managed_windows[i] == window) {
-      found = 1;
-      break;
-    }
+  if (input->timings) {
+    unsigned int sequence = xcb_no_operation(xcon).sequence;
+    fprintf(stderr,
+            "timings:%s total_ms=%" PRId64 ".%03d total_rt=%d"
+            " total_requests=%u\n",
+            TIMINGS.line,
+            TIMINGS.total_us / 1000,
+            (int)(TIMINGS.total_us % 1000),
+            TIMINGS.total_round_trips,
+            sequence - TIMINGS.printed - 1);
+    TIMINGS.printed = sequence;
   }
-  return found;
+  TIMINGS.line[0] = '\0';
+  TIMINGS.line_size = 0;
+  TIMINGS.total_us = 0;
+  TIMINGS.total_round_trips = 0;
 }
 
+// -- xid tables
+
 /**
- * Determine whether a window is in the list of windows.
+ * Hash an X resource ID into a slot index of an `xid_table_t`.
  */
 int
-xorg_contains_window(
-  xcb_window_t* windows,
-  int windows_size,
-  xcb_window_t window)
+xid_table_hash(xid_table_t* table, uint32_t key)
 {
-  int found = 0;
-  for (int i = 0; i < windows_size; i++) {
-    if (windows[i] == window) {
-      found = 1;
-      break;
-    }
-  }
-  return found;
+  // Fibonacci hashing: IDs are mostly sequential, so spread them out
+  return (int)((key * 2654435769u) & (table->capacity - 1));
 }
 
 /**
- * Initialise the connection to the X server.
+ * Create an empty `xid_table_t`.
  *
- * state (output): pointer to program state; `input` and `wsetups` are not
- *     initialised
+ * size_hint: number of entries expected, to avoid growing the table
  */
-void
-initialise_xorg(xcw_state_t** state)
+xid_table_t*
+xid_table_create(int size_hint)
 {
-  int default_screen; // unused
-  xcb_screen_t* screen;
-  xcb_connection_t* xcon = xcb_connect(NULL, &default_screen);
-  if (xcb_connection_has_error(xcon))
-    xcw_die("connect\n");
+  int capacity = 16;
+  while (capacity < size_hint * 2)
+    capacity *= 2;
+
+  xid_table_t* table = xcw_malloc(HEAP_TABLES, sizeof(xid_table_t));
+  table->keys = xcw_calloc(HEAP_TABLES, capacity, sizeof(uint32_t));
+  table->values = xcw_calloc(HEAP_TABLES, capacity, sizeof(void*));
+  table->capacity = capacity;
+  table->size = 0;
+  return table;
+}
 
-  screen = xcb_setup_roots_iterator(xcb_get_setup(xcon)).data;
-  if (screen == NULL)
-    xcw_die("no screens\n");
-  xcb_window_t xroot = screen->root;
+/**
+ * Free an `xid_table_t`.  Values aren't freed.
+ */
+void
+xid_table_free(xid_table_t* table)
+{
+  xcw_free(HEAP_TABLES, table->keys);
+  xcw_free(HEAP_TABLES, table->values);
+  xcw_free(HEAP_TABLES, table);
+}
 
-  xcb_ewmh_connection_t ewmh;
-  xcb_intern_atom_cookie_t* ewmhc = xcb_ewmh_init_atoms(xcon, &ewmh);
-  if (!xcb_ewmh_init_atoms_replies(&ewmh, ewmhc, NULL)) {
-    xcw_die("ewmh init\n");
-  }
+/**
+ * Find the slot holding a key, or the empty slot where it would be inserted.
+ */
+int
+xid_table_slot(xid_table_t* table, uint32_t key)
+{
+  int i = xid_table_hash(table, key);
+  while (table->keys[i] != XCB_NONE && table->keys[i] != key)
+    i = (i + 1) & (table->capacity - 1);
+  return i;
+}
 
-  xcb_key_symbols_t* ksymbols;
-  ksymbols = xcb_key_symbols_alloc(xcon);
-  if (ksymbols == NULL)
-    xcw_die("key_symbols_alloc\n");
+void
+xid_table_set(xid_table_t* table, uint32_t key, void* value);
 
-  xcb_font_t overlay_font = xcb_generate_id(xcon);
-  xcb_void_cookie_t ofc = xcb_open_font_checked(
-    xcon, overlay_font, strlen(OVERLAY_FONT_NAME), OVERLAY_FONT_NAME);
-  xorg_check_request(xcon, ofc, "open_font");
+/**
+ * Double the capacity of an `xid_table_t`.
+ */
+void
+xid_table_grow(xid_table_t* table)
+{
+  uint32_t* keys = table->keys;
+  void** values = table->values;
+  int capacity = table->capacity;
+
+  table->capacity = capacity * 2;
+  table->keys = xcw_calloc(HEAP_TABLES, table->capacity, sizeof(uint32_t));
+  table->values = xcw_calloc(HEAP_TABLES, table->capacity, sizeof(void*));
+  table->size = 0;
+  for (int i = 0; i < capacity; i++) {
+    if (keys[i] != XCB_NONE)
+      xid_table_set(table, keys[i], values[i]);
+  }
 
-  *state = malloc(sizeof(xcw_state_t));
-  xcw_state_t local_state = { xcon,         xroot, ewmh, ksymbols,
-                              overlay_font, NULL,  NULL, 0 };
-  **state = local_state;
+  xcw_free(HEAP_TABLES, keys);
+  xcw_free(HEAP_TABLES, values);
 }
 
-// -- input handling
-
 /**
- * Find an item in a keysym lookup given its character.
- *
- * ksl: keysym lookup to search
- * c: character to search for
+ * Add an entry to an `xid_table_t`, replacing any existing entry for the key.
  *
- * returns: found item, NULL if no matching items were found
+ * key: must not be `XCB_NONE`
  */
-keysyms_lookup_t*
-keysyms_lookup_find_char(keysyms_lookup_t* ksl, int ksl_size, char c)
+void
+xid_table_set(xid_table_t* table, uint32_t key, void* value)
 {
-  for (int i = 0; i < ksl_size; i++) {
-    if (ksl[i].character == c) {
-      return &(ksl[i]);
-    }
+  // keep the load factor at most 1/2
+  if ((table->size + 1) * 2 > table->capacity)
+    xid_table_grow(table);
+
+  int i = xid_table_slot(table, key);
+  if (table->keys[i] == XCB_NONE) {
+    table->keys[i] = key;
+    table->size += 1;
   }
-  return NULL;
+  table->values[i] = value;
 }
 
 /**
- * Find an item in a keysym lookup given its keysym.
- *
- * ksl: keysym lookup to search
- * ksym: keysym to search for
+ * Look up a key in an `xid_table_t`.
  *
- * returns: found item, NULL if no matching items were found
+ * returns: the value for `key`, or NULL if it isn't present
  */
-keysyms_lookup_t*
-keysyms_lookup_find_keysym(
-  keysyms_lookup_t* ksl,
-  int ksl_size,
-  xcb_keysym_t ksym)
+void*
+xid_table_get(xid_table_t* table, uint32_t key)
 {
-  for (int i = 0; i < ksl_size; i++) {
-    if (ksl[i].keysym == ksym) {
-      return &(ksl[i]);
+  return table->values[xid_table_slot(table, key)];
+}
+
+/**
+ * Determine whether a key is present in an `xid_table_t`.
+ */
+int
+xid_table_contains(xid_table_t* table, uint32_t key)
+{
+  return key != XCB_NONE && table->keys[xid_table_slot(table, key)] == key;
+}
+
+/**
+ * Create an `xid_table_t` used as a set of windows, with NULL values.
+ */
+xid_table_t*
+xid_table_from_windows(xcb_window_t* windows, int windows_size)
+{
+  xid_table_t* table = xid_table_create(windows_size);
+  for (int i = 0; i < windows_size; i++)
+    xid_table_set(table, windows[i], NULL);
+  return table;
+}
+
+/**
+ * Remove a key from an `xid_table_t`, if present.
+ */
+void
+xid_table_remove(xid_table_t* table, uint32_t key)
+{
+  int mask = table->capacity - 1;
+  int i = xid_table_slot(table, key);
+  if (table->keys[i] == XCB_NONE)
+    return;
+
+  // shift back any following entries that would no longer be reachable
+  for (int j = (i + 1) & mask; table->keys[j] != XCB_NONE; j = (j + 1) & mask) {
+    int k = xid_table_hash(table, table->keys[j]);
+    if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+      continue;
+    table->keys[i] = table->keys[j];
+    table->values[i] = table->values[j];
+    i = j;
+  }
+
+  table->keys[i] = XCB_NONE;
+  table->values[i] = NULL;
+  table->size -= 1;
+}
+
+// -- selection history
+
+/**
+ * Compare `history_entry_t` items by class.
+ */
+int
+history_entry_compare(const void* a, const void* b)
+{
+  return strcmp(((history_entry_t*)a)->window_class,
+                ((history_entry_t*)b)->window_class);
+}
+
+/**
+ * Find the entry for a class in the history.
+ *
+ * returns: the entry, NULL if the class has never been chosen
+ */
+history_entry_t*
+history_find(history_t* history, char* window_class)
+{
+  if (window_class == NULL || history->size == 0)
+    return NULL;
+  history_entry_t key = { window_class, 0 };
+  return bsearch(&key,
+                 history->entries,
+                 history->size,
+                 sizeof(history_entry_t),
+                 history_entry_compare);
+}
+
+/**
+ * Load the history saved by earlier runs, from `HISTORY_NAME` in
+ * `$XDG_STATE_HOME` (or `~/.local/state`).  A missing or unreadable file
+ * leaves the history empty.
+ */
+void
+history_load(history_t* history)
+{
+  char* state_home = getenv("XDG_STATE_HOME");
+  char* home = getenv("HOME");
+  char path[4096];
+  if (state_home != NULL && state_home[0] != '\0') {
+    snprintf(path, sizeof(path), "%s/%s", state_home, HISTORY_NAME);
+  } else if (home != NULL) {
+    snprintf(path, sizeof(path), "%s/.local/state/%s", home, HISTORY_NAME);
+  } else {
+    return;
+  }
+  history->path = xcw_strdup(HEAP_HISTORY, path);
+
+  FILE* file = fopen(history->path, "r");
+  if (file == NULL)
+    return;
+  // each line is a count, a space and a class name
+  char line[1024];
+  int capacity = 0;
+  while (fgets(line, sizeof(line), file) != NULL) {
+    char* window_class = strchr(line, ' ');
+    if (window_class == NULL)
+      continue;
+    *window_class = '\0';
+    window_class += 1;
+    window_class[strcspn(window_class, "\n")] = '\0';
+    if (history->size == capacity) {
+      capacity = max(capacity * 2, 16);
+      history->entries = xcw_realloc(
+        HEAP_HISTORY, history->entries, capacity * sizeof(history_entry_t));
+    }
+    history_entry_t entry = { xcw_strdup(HEAP_HISTORY, window_class),
+                              atoi(line) };
+    history->entries[history->size] = entry;
+    history->size += 1;
+  }
+  fclose(file);
+  qsort(history->entries,
+        history->size,
+        sizeof(history_entry_t),
+        history_entry_compare);
+}
+
+/**
+ * Save the history for later runs.  Failures only produce a warning.
+ */
+void
+history_save(history_t* history)
+{
+  if (history->path == NULL)
+    return;
+  // the state directory doesn't exist on a fresh account
+  if (!make_parent_dirs(history->path)) {
+    xcw_warn(
+      "couldn't save history to %s: %s\n", history->path, strerror(errno));
+    return;
+  }
+  // replace the file in one step, so a concurrent run never sees half of it
+  char tmp_path[4096];
+  snprintf(tmp_path, sizeof(tmp_path), "%s.%d", history->path, getpid());
+  FILE* file = fopen(tmp_path, "w");
+  if (file == NULL) {
+    xcw_warn("couldn't save history to %s: %s\n", tmp_path, strerror(errno));
+    return;
+  }
+  for (int i = 0; i < history->size; i++) {
+    history_entry_t* entry = &(history->entries[i]);
+    fprintf(file, "%d %s\n", entry->count, entry->window_class);
+  }
+  if (fclose(file) != 0 || rename(tmp_path, history->path) != 0) {
+    xcw_warn("couldn't save history to %s: %s\n", tmp_path, strerror(errno));
+    unlink(tmp_path);
+  }
+}
+
+/**
+ * Record that a window of a class was chosen, and save the history.
+ *
+ * window_class: NULL if the window doesn't have a class, in which case nothing
+ *     is recorded
+ */
+void
+history_record(history_t* history, char* window_class)
+{
+  if (window_class == NULL || strchr(window_class, '\n') != NULL)
+    return;
+  history_entry_t* entry = history_find(history, window_class);
+  if (entry != NULL) {
+    entry->count += 1;
+  } else {
+    history->entries =
+      xcw_realloc(HEAP_HISTORY,
+                  history->entries,
+                  (history->size + 1) * sizeof(history_entry_t));
+    history_entry_t new_entry = { xcw_strdup(HEAP_HISTORY, window_class), 1 };
+    history->entries[history->size] = new_entry;
+    history->size += 1;
+    qsort(history->entries,
+          history->size,
+          sizeof(history_entry_t),
+          history_entry_compare);
+  }
+  history_save(history);
+}
+
+/**
+ * Compute the weight a window is given when assigning labels: one more than the
+ * number of times windows of its class have been chosen.
+ */
+int64_t
+history_weight(history_t* history, char* window_class)
+{
+  history_entry_t* entry = history_find(history, window_class);
+  return entry == NULL ? 1 : (int64_t)entry->count + 1;
+}
+
+// -- glyph files
+
+/**
+ * Add bytes to an FNV-1a hash.
+ *
+ * hash: the hash so far, or 14695981039346656037 to start one
+ */
+uint64_t
+fnv1a(uint64_t hash, const void* data, size_t size)
+{
+  const uint8_t* bytes = data;
+  for (size_t i = 0; i < size; i++)
+    hash = (hash ^ bytes[i]) * 1099511628211u;
+  return hash;
+}
+
+/**
+ * Find where the glyphs for a font and set of characters are saved:
+ * `GLYPH_FILE_NAME` with a hash of what identifies them, in `$XDG_CACHE_HOME`
+ * (or `~/.cache`).
+ *
+ * holder: codepoints of the glyphs
+ * path (output): path of the glyph file
+ * size: size of `path`
+ *
+ * returns: whether there's somewhere to save glyphs
+ */
+int
+glyph_file_path(
+  char* font_path,
+  int font_size,
+  struct utf_holder holder,
+  char* path,
+  int size)
+{
+  uint64_t hash = 14695981039346656037u;
+  hash = fnv1a(hash, font_path, strlen(font_path));
+  hash = fnv1a(hash, &font_size, sizeof(font_size));
+  hash = fnv1a(hash, &FONT_DPI, sizeof(FONT_DPI));
+  hash = fnv1a(hash, holder.str, holder.length * sizeof(*holder.str));
+
+  char* cache_home = getenv("XDG_CACHE_HOME");
+  char* home = getenv("HOME");
+  if (cache_home != NULL && cache_home[0] != '\0') {
+    snprintf(
+      path, size, "%s/%s-%016" PRIx64, cache_home, GLYPH_FILE_NAME, hash);
+  } else if (home != NULL) {
+    snprintf(
+      path, size, "%s/.cache/%s-%016" PRIx64, home, GLYPH_FILE_NAME, hash);
+  } else {
+    return 0;
+  }
+  return 1;
+}
+
+/**
+ * Fill a glyph file header with what identifies a set of glyphs.
+ *
+ * font_stat: `stat` of the font file
+ * size: number of glyphs
+ * data_size: size of the glyph images in bytes
+ */
+glyph_file_header_t
+glyph_file_header(
+  char* font_path,
+  struct stat* font_stat,
+  int font_size,
+  int size,
+  int data_size)
+{
+  glyph_file_header_t header;
+  // zero the padding too, so headers can be compared with `memcmp`
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, GLYPH_FILE_MAGIC, sizeof(header.magic));
+  header.font_mtime_sec = font_stat->st_mtim.tv_sec;
+  header.font_mtime_nsec = font_stat->st_mtim.tv_nsec;
+  header.font_file_size = font_stat->st_size;
+  header.font_size = font_size;
+  header.dpi = FONT_DPI;
+  header.path_size = strlen(font_path);
+  header.size = size;
+  header.data_size = data_size;
+  return header;
+}
+
+/**
+ * returns: the size of a glyph file holding `size` glyphs, once every section
+ *     up to and including `offsets` is added
+ */
+size_t
+glyph_file_size(int path_size, int size)
+{
+  return sizeof(glyph_file_header_t) + ((path_size + 3) & ~3) +
+         size * (sizeof(uint32_t) + sizeof(xcb_render_glyphinfo_t) +
+                 sizeof(glyph_metrics_t) + sizeof(int));
+}
+
+/**
+ * Check the glyph images of a glyph file lie within its data, so a damaged
+ * file is rasterised again instead of being read past its end.
+ *
+ * infos, offsets: of the glyphs in the file
+ * size: number of glyphs
+ * data_size: size of the glyph images in bytes
+ */
+int
+glyph_file_images_fit(
+  xcb_render_glyphinfo_t* infos,
+  int* offsets,
+  int size,
+  int data_size)
+{
+  for (int i = 0; i < size; i++) {
+    // rows are padded to 4 bytes, like `glyph_raster_create` writes them
+    int64_t image_size = (int64_t)((infos[i].width + 3) & ~3) * infos[i].height;
+    if (offsets[i] < 0 || offsets[i] + image_size > data_size)
+      return 0;
+  }
+  return 1;
+}
+
+/**
+ * Load glyphs saved by an earlier run.  The file is mapped into memory rather
+ * than read, and the glyph images are used where they lie.  Only a file saved
+ * with the same font file, unchanged, and the same size and characters is
+ * used.
+ *
+ * path: the glyph file
+ * font_stat: `stat` of the font file
+ * holder: codepoints of the glyphs wanted
+ * raster (output): the glyphs, to be freed with `glyph_raster_free` (only set
+ *     if they're loaded)
+ *
+ * returns: whether the glyphs were loaded
+ */
+int
+glyph_file_load(
+  char* path,
+  char* font_path,
+  struct stat* font_stat,
+  int font_size,
+  struct utf_holder holder,
+  glyph_raster_t* raster)
+{
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return 0;
+  struct stat file_stat;
+  if (
+    fstat(fd, &file_stat) != 0 ||
+    file_stat.st_size < sizeof(glyph_file_header_t)) {
+    close(fd);
+    return 0;
+  }
+  size_t mapping_size = file_stat.st_size;
+  uint8_t* mapping = mmap(NULL, mapping_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED)
+    return 0;
+
+  glyph_file_header_t* header = (glyph_file_header_t*)mapping;
+  glyph_file_header_t expected = glyph_file_header(
+    font_path, font_stat, font_size, holder.length, header->data_size);
+  size_t size = glyph_file_size(expected.path_size, holder.length);
+  uint8_t* at = mapping + sizeof(glyph_file_header_t);
+  if (
+    memcmp(header, &expected, sizeof(expected)) != 0 || header->data_size < 0 ||
+    mapping_size != size + header->data_size ||
+    memcmp(at, font_path, expected.path_size) != 0) {
+    munmap(mapping, mapping_size);
+    return 0;
+  }
+  at += (expected.path_size + 3) & ~3;
+  xcb_render_glyphinfo_t* infos =
+    (xcb_render_glyphinfo_t*)(at + holder.length * sizeof(uint32_t));
+  int* offsets = (int*)((uint8_t*)(infos + holder.length) +
+                        holder.length * sizeof(glyph_metrics_t));
+  if (
+    memcmp(at, holder.str, holder.length * sizeof(uint32_t)) != 0 ||
+    !glyph_file_images_fit(infos, offsets, holder.length, header->data_size)) {
+    munmap(mapping, mapping_size);
+    return 0;
+  }
+
+  raster->size = holder.length;
+  raster->ids = (uint32_t*)at;
+  at += holder.length * sizeof(uint32_t);
+  raster->infos = (xcb_render_glyphinfo_t*)at;
+  at += holder.length * sizeof(xcb_render_glyphinfo_t);
+  // the glyph cache keeps and reorders the metrics
+  raster->metrics =
+    xcw_malloc(HEAP_GLYPHS, holder.length * sizeof(glyph_metrics_t));
+  memcpy(raster->metrics, at, holder.length * sizeof(glyph_metrics_t));
+  at += holder.length * sizeof(glyph_metrics_t);
+  raster->offsets = (int*)at;
+  at += holder.length * sizeof(int);
+  raster->data = at;
+  raster->data_size = header->data_size;
+  raster->mapping = mapping;
+  raster->mapping_size = mapping_size;
+  return 1;
+}
+
+/**
+ * Save glyphs for later runs to load with `glyph_file_load`.  Failures only
+ * produce a warning.
+ *
+ * path: the glyph file
+ * font_stat: `stat` of the font file
+ */
+void
+glyph_file_save(
+  char* path,
+  char* font_path,
+  struct stat* font_stat,
+  int font_size,
+  glyph_raster_t* raster)
+{
+  // the cache directory doesn't exist on a fresh account
+  if (!make_parent_dirs(path)) {
+    xcw_warn("couldn't save glyphs to %s: %s\n", path, strerror(errno));
+    return;
+  }
+  // replace the file in one step, so a concurrent run never sees half of it
+  char tmp_path[4096];
+  snprintf(tmp_path, sizeof(tmp_path), "%s.%d", path, getpid());
+  FILE* file = fopen(tmp_path, "w");
+  if (file == NULL) {
+    xcw_warn("couldn't save glyphs to %s: %s\n", tmp_path, strerror(errno));
+    return;
+  }
+
+  glyph_file_header_t header = glyph_file_header(
+    font_path, font_stat, font_size, raster->size, raster->data_size);
+  uint8_t padding[3] = { 0, 0, 0 };
+  fwrite(&header, sizeof(header), 1, file);
+  fwrite(font_path, 1, header.path_size, file);
+  fwrite(padding, 1, -header.path_size & 3, file);
+  fwrite(raster->ids, sizeof(uint32_t), raster->size, file);
+  fwrite(raster->infos, sizeof(xcb_render_glyphinfo_t), raster->size, file);
+  fwrite(raster->metrics, sizeof(glyph_metrics_t), raster->size, file);
+  fwrite(raster->offsets, sizeof(int), raster->size, file);
+  fwrite(raster->data, 1, raster->data_size, file);
+  int failed = ferror(file);
+  if (fclose(file) != 0 || failed || rename(tmp_path, path) != 0) {
+    xcw_warn("couldn't save glyphs to %s: %s\n", tmp_path, strerror(errno));
+    unlink(tmp_path);
+  }
+}
+
+// -- xorg utilities
+
+/**
+ * Remember an unchecked, reply-less request, so that an error it causes can be
+ * reported by name when the event loop receives it.  This doesn't wait for the
+ * server.
+ *
+ * cookie: corresponding to the request
+ * msg: to print in case of error
+ */
+void
+xorg_track_request(request_log_t* log, xcb_void_cookie_t cookie, char* msg)
+{
+  log->sequences[log->next] = cookie.sequence;
+  log->names[log->next] = msg;
+  log->next = (log->next + 1) % REQUEST_LOG_SIZE;
+}
+
+/**
+ * Find the name of a request remembered by `xorg_track_request`.
+ *
+ * sequence: full sequence number of the request
+ * returns: the name, NULL if it isn't in the log
+ */
+char*
+xorg_tracked_request(request_log_t* log, unsigned int sequence)
+{
+  for (int i = 0; i < REQUEST_LOG_SIZE; i++) {
+    if (log->names[i] != NULL && log->sequences[i] == sequence)
+      return log->names[i];
+  }
+  return NULL;
+}
+
+/**
+ * Move and resize a window.
+ *
+ * x, y: new absolute screen location
+ */
+void
+xorg_window_move_resize(
+  xcb_connection_t* xcon,
+  xcb_window_t window,
+  int x,
+  int y,
+  int w,
+  int h)
+{
+  int mask =
+    (XCB_CONFIG_WINDOW_X | XCB_CONFIG_WINDOW_Y | XCB_CONFIG_WINDOW_WIDTH |
+     XCB_CONFIG_WINDOW_HEIGHT);
+  uint32_t values[] = { x, y, w, h };
+  XCW_REQUEST(xcb_configure_window, xcon, window, mask, values);
+}
+
+/**
+ * Find a font with a glyph for a character, using fontconfig.
+ *
+ * returns: the font file (to be freed by the caller), or NULL if no font has
+ *     the character
+ */
+char*
+font_fallback_path(FcChar32 codepoint)
+{
+  FcPattern* pattern = FcPatternCreate();
+  FcCharSet* charset = FcCharSetCreate();
+  FcCharSetAddChar(charset, codepoint);
+  FcPatternAddCharSet(pattern, FC_CHARSET, charset);
+  FcConfigSubstitute(NULL, pattern, FcMatchPattern);
+  FcDefaultSubstitute(pattern);
+  FcResult result;
+  FcPattern* match = FcFontMatch(NULL, pattern, &result);
+
+  // the best match may still not have the character
+  char* path = NULL;
+  FcChar8* file;
+  FcCharSet* match_charset;
+  if (
+    match != NULL &&
+    FcPatternGetString(match, FC_FILE, 0, &file) == FcResultMatch &&
+    FcPatternGetCharSet(match, FC_CHARSET, 0, &match_charset) ==
+      FcResultMatch &&
+    FcCharSetHasChar(match_charset, codepoint)) {
+    path = xcw_strdup(HEAP_GLYPHS, (char*)file);
+  }
+
+  if (match != NULL)
+    FcPatternDestroy(match);
+  FcPatternDestroy(pattern);
+  FcCharSetDestroy(charset);
+  return path;
+}
+
+/**
+ * Find a fallback face with a glyph for a character, opening it if it isn't
+ * one of `fallbacks` already.
+ *
+ * font_size: size to rasterise at
+ *
+ * returns: the face, or NULL if no font has the character
+ */
+FT_Face
+glyph_fallback_face(
+  FT_Library library,
+  int font_size,
+  FcChar32 codepoint,
+  fallback_faces_t* fallbacks)
+{
+  char* path = font_fallback_path(codepoint);
+  if (path == NULL)
+    return NULL;
+  for (int i = 0; i < fallbacks->size; i++) {
+    if (strcmp(fallbacks->paths[i], path) == 0) {
+      xcw_free(HEAP_GLYPHS, path);
+      return fallbacks->faces[i];
+    }
+  }
+
+  FT_Face face;
+  if (FT_New_Face(library, path, 0, &face)) {
+    xcw_free(HEAP_GLYPHS, path);
+    return NULL;
+  }
+  FT_Set_Char_Size(face, 0, font_size * 64, FONT_DPI, FONT_DPI);
+  FT_Select_Charmap(face, ft_encoding_unicode);
+  int size = fallbacks->size + 1;
+  fallbacks->paths =
+    xcw_realloc(HEAP_GLYPHS, fallbacks->paths, size * sizeof(char*));
+  fallbacks->faces =
+    xcw_realloc(HEAP_GLYPHS, fallbacks->faces, size * sizeof(FT_Face));
+  fallbacks->paths[size - 1] = path;
+  fallbacks->faces[size - 1] = face;
+  fallbacks->size = size;
+  return face;
+}
+
+/**
+ * Rasterise glyphs for a set of characters.  Characters `face` doesn't have are
+ * taken from fallback fonts chosen by fontconfig.
+ *
+ * face: the font's face, already sized
+ * font_size: size `face` was set to
+ * holder: codepoints to rasterise
+ * raster (output): the glyph images, to be freed with `glyph_raster_free`
+ */
+void
+glyph_raster_create(
+  FT_Library library,
+  FT_Face face,
+  int font_size,
+  struct utf_holder holder,
+  glyph_raster_t* raster)
+{
+  int size = holder.length;
+  raster->size = size;
+  raster->ids = xcw_calloc(HEAP_GLYPHS, size, sizeof(uint32_t));
+  raster->infos = xcw_calloc(HEAP_GLYPHS, size, sizeof(xcb_render_glyphinfo_t));
+  raster->metrics = xcw_calloc(HEAP_GLYPHS, size, sizeof(glyph_metrics_t));
+  raster->offsets = xcw_calloc(HEAP_GLYPHS, size, sizeof(int));
+  int capacity = 4096;
+  raster->data = xcw_malloc(HEAP_GLYPHS, capacity);
+  raster->data_size = 0;
+  raster->mapping = NULL;
+  raster->mapping_size = 0;
+
+  fallback_faces_t fallbacks = { NULL, NULL, 0 };
+  FT_Select_Charmap(face, ft_encoding_unicode);
+  for (int n = 0; n < size; n++) {
+    FcChar32 charcode = holder.str[n];
+    FT_Face glyph_face = face;
+    int glyph_index = FT_Get_Char_Index(face, charcode);
+    if (glyph_index == 0) {
+      FT_Face fallback =
+        glyph_fallback_face(library, font_size, charcode, &fallbacks);
+      if (fallback != NULL) {
+        glyph_face = fallback;
+        glyph_index = FT_Get_Char_Index(fallback, charcode);
+      } else {
+        // the font's 'missing' glyph is used
+        xcw_warn("character %d not found\n", charcode);
+      }
+    }
+    FT_Load_Glyph(
+      glyph_face, glyph_index, FT_LOAD_RENDER | FT_LOAD_FORCE_AUTOHINT);
+
+    FT_GlyphSlot slot = glyph_face->glyph;
+    FT_Bitmap* bitmap = &slot->bitmap;
+    xcb_render_glyphinfo_t ginfo;
+    ginfo.x = -slot->bitmap_left;
+    ginfo.y = slot->bitmap_top;
+    ginfo.width = bitmap->width;
+    ginfo.height = bitmap->rows;
+    ginfo.x_off = slot->advance.x / 64;
+    ginfo.y_off = slot->advance.y / 64;
+
+    glyph_metrics_t m = { charcode,
+                          slot->bitmap_left,
+                          ginfo.width,
+                          ginfo.x_off,
+                          slot->bitmap_top,
+                          ginfo.height - slot->bitmap_top,
+                          0 };
+
+    raster->ids[n] = charcode;
+    raster->infos[n] = ginfo;
+    raster->metrics[n] = m;
+    raster->offsets[n] = raster->data_size;
+
+    // the protocol requires each row to be padded to 4 bytes
+    int stride = (ginfo.width + 3) & ~3;
+    int image_size = stride * ginfo.height;
+    if (raster->data_size + image_size > capacity) {
+      while (raster->data_size + image_size > capacity)
+        capacity *= 2;
+      raster->data = xcw_realloc(HEAP_GLYPHS, raster->data, capacity);
+    }
+
+    uint8_t* image = raster->data + raster->data_size;
+    memset(image, 0, image_size);
+    for (int y = 0; y < ginfo.height; y++) {
+      memcpy(
+        image + y * stride, bitmap->buffer + y * bitmap->pitch, ginfo.width);
+    }
+    raster->data_size += image_size;
+  }
+
+  for (int i = 0; i < fallbacks.size; i++) {
+    FT_Done_Face(fallbacks.faces[i]);
+    xcw_free(HEAP_GLYPHS, fallbacks.paths[i]);
+  }
+  xcw_free(HEAP_GLYPHS, fallbacks.paths);
+  xcw_free(HEAP_GLYPHS, fallbacks.faces);
+}
+
+/**
+ * Free the memory used by a `glyph_raster_t`.
+ */
+void
+glyph_raster_free(glyph_raster_t* raster)
+{
+  xcw_free(HEAP_GLYPHS, raster->metrics);
+  if (raster->mapping != NULL) {
+    munmap(raster->mapping, raster->mapping_size);
+    return;
+  }
+  xcw_free(HEAP_GLYPHS, raster->ids);
+  xcw_free(HEAP_GLYPHS, raster->infos);
+  xcw_free(HEAP_GLYPHS, raster->offsets);
+  xcw_free(HEAP_GLYPHS, raster->data);
+}
+
+/**
+ * Rasterise the glyphs of a `glyph_job_t`, as the job's thread.  Errors are
+ * left in `job->error`, as only the main thread exits the process.
+ */
+void*
+glyph_job_run(void* data)
+{
+  glyph_job_t* job = data;
+  FT_Library library;
+  FT_Face face;
+  if (FT_Init_FreeType(&library)) {
+    snprintf(job->error, sizeof(job->error), "FT_Init_FreeType");
+    return NULL;
+  }
+  if (FT_New_Face(library, job->font_path, 0, &face)) {
+    snprintf(
+      job->error, sizeof(job->error), "couldn't load font: %s", job->font_path);
+    FT_Done_FreeType(library);
+    return NULL;
+  }
+  FT_Set_Char_Size(face, 0, job->font_size * 64, FONT_DPI, FONT_DPI);
+  glyph_raster_create(
+    library, face, job->font_size, job->codepoints, &(job->raster));
+  FT_Done_Face(face);
+  FT_Done_FreeType(library);
+  return NULL;
+}
+
+/**
+ * Start rasterising the glyphs of a job in another thread, so that it overlaps
+ * with whatever the main thread does next.  A label pool has at most 36
+ * characters, too few for splitting them between threads to pay for loading
+ * the font in each.
+ */
+void
+glyph_job_start(glyph_job_t* job, char* font_path, int font_size)
+{
+  job->font_path = font_path;
+  job->font_size = font_size;
+  job->error[0] = '\0';
+  if (pthread_create(&(job->thread), NULL, glyph_job_run, job) != 0)
+    xcw_die("pthread_create\n");
+}
+
+/**
+ * Wait for the thread started by `glyph_job_start`, and exit the process if it
+ * failed.
+ */
+void
+glyph_job_finish(glyph_job_t* job)
+{
+  pthread_join(job->thread, NULL);
+  if (job->error[0] != '\0')
+    xcw_die("%s\n", job->error);
+}
+
+/**
+ * Upload rasterised glyphs to a glyphset.  Glyphs are sent in as few
+ * `add_glyphs` requests as the server's maximum request length allows,
+ * usually just one.
+ *
+ * gs: glyphset to add the glyphs to
+ */
+void
+glyph_raster_upload(
+  xcb_connection_t* xcon,
+  xcb_render_glyphset_t gs,
+  glyph_raster_t* raster)
+{
+  // in bytes; the request length is in 4-byte units
+  uint64_t max_bytes = (uint64_t)xcb_get_maximum_request_length(xcon) * 4;
+  // header, glyphset and glyph count
+  uint64_t header_bytes = 12;
+
+  int start = 0;
+  while (start < raster->size) {
+    uint64_t bytes = header_bytes;
+    int end = start;
+    while (end < raster->size) {
+      int image_end =
+        end + 1 < raster->size ? raster->offsets[end + 1] : raster->data_size;
+      uint64_t glyph_bytes = sizeof(uint32_t) + sizeof(xcb_render_glyphinfo_t) +
+                             image_end - raster->offsets[end];
+      // always send at least one glyph per request
+      if (end > start && bytes + glyph_bytes > max_bytes)
+        break;
+      bytes += glyph_bytes;
+      end += 1;
+    }
+
+    int data_end =
+      end < raster->size ? raster->offsets[end] : raster->data_size;
+    XCW_REQUEST(
+      xcb_render_add_glyphs,
+      xcon,
+      gs,
+      end - start,
+      raster->ids + start,
+      raster->infos + start,
+      data_end - raster->offsets[start],
+      raster->data + raster->offsets[start]);
+    start = end;
+  }
+}
+
+/**
+ * Upload rasterised glyphs through MIT-SHM to the atlas of a glyph cache, with
+ * each glyph's image below the previous one.  Render only accepts glyphset
+ * images sent over the connection, so labels are drawn from the atlas with
+ * `glyph_atlas_draw` instead.
+ *
+ * This needs a single round trip, to find out whether the X server could
+ * attach the shared segment: it can't if it's on another machine.
+ *
+ * returns: whether the glyphs were uploaded; if not, `cache->atlas` is left
+ *     as `XCB_NONE`
+ */
+int
+glyph_atlas_upload(
+  xcw_state_t* state,
+  glyph_cache_t* cache,
+  glyph_raster_t* raster)
+{
+  xcb_connection_t* xcon = state->xcon;
+  const xcb_query_extension_reply_t* shm_ext =
+    xcb_get_extension_data(xcon, &xcb_shm_id);
+  if (shm_ext == NULL || !shm_ext->present)
+    return 0;
+
+  // rows of 8-bit images are padded to 4 bytes, like glyph images
+  int stride = 4;
+  int height = 0;
+  for (int n = 0; n < raster->size; n++) {
+    stride = max(stride, (raster->infos[n].width + 3) & ~3);
+    raster->metrics[n].atlas_y = height;
+    height += raster->infos[n].height;
+  }
+  // the largest size of a pixmap
+  if (height == 0 || height > 32767 || stride > 32767)
+    return 0;
+
+  int shmid = shmget(IPC_PRIVATE, stride * height, IPC_CREAT | 0600);
+  if (shmid < 0)
+    return 0;
+  uint8_t* image = shmat(shmid, NULL, 0);
+  if (image == (void*)-1) {
+    shmctl(shmid, IPC_RMID, NULL);
+    return 0;
+  }
+  // a new segment is zeroed, so only the glyphs themselves need copying
+  for (int n = 0; n < raster->size; n++) {
+    int width = raster->infos[n].width;
+    int glyph_stride = (width + 3) & ~3;
+    for (int y = 0; y < raster->infos[n].height; y++) {
+      memcpy(image + (raster->metrics[n].atlas_y + y) * stride,
+             raster->data + raster->offsets[n] + y * glyph_stride,
+             width);
+    }
+  }
+
+  xcb_shm_seg_t seg = xcb_generate_id(xcon);
+  xcb_void_cookie_t sac = XCW_REQUEST(
+    xcb_shm_attach_checked, xcon, seg, shmid, 1);
+  stats_created(RESOURCE_SHM_SEGMENT);
+  xcb_pixmap_t pixmap = xcb_generate_id(xcon);
+  XCW_REQUEST(xcb_create_pixmap, xcon, 8, pixmap, state->xroot, stride, height);
+  stats_created(RESOURCE_PIXMAP);
+  xcb_gcontext_t gc = xcb_generate_id(xcon);
+  XCW_REQUEST(xcb_create_gc, xcon, gc, pixmap, 0, NULL);
+  stats_created(RESOURCE_GC);
+  xcb_void_cookie_t spic = XCW_REQUEST(
+    xcb_shm_put_image_checked,
+    xcon,
+    pixmap,
+    gc,
+    stride,
+    height,
+    0,
+    0,
+    stride,
+    height,
+    0,
+    0,
+    8,
+    XCB_IMAGE_FORMAT_Z_PIXMAP,
+    0,
+    seg,
+    0);
+  xcb_void_cookie_t sdc = XCW_REQUEST(xcb_shm_detach_checked, xcon, seg);
+  stats_freed(RESOURCE_SHM_SEGMENT);
+  XCW_REQUEST(xcb_free_gc, xcon, gc);
+  stats_freed(RESOURCE_GC);
+
+  // if attaching failed, so did the rest
+  timings_wait(sdc.sequence);
+  xcb_generic_error_t* errors[] = { xcb_request_check(xcon, sac),
+                                    xcb_request_check(xcon, spic),
+                                    xcb_request_check(xcon, sdc) };
+  // the server is done with the segment
+  shmdt(image);
+  shmctl(shmid, IPC_RMID, NULL);
+  int failed = 0;
+  for (int i = 0; i < sizeof(errors) / sizeof(*errors); i++) {
+    if (errors[i] != NULL)
+      failed = 1;
+    free(errors[i]);
+  }
+  if (failed) {
+    XCW_REQUEST(xcb_free_pixmap, xcon, pixmap);
+    stats_freed(RESOURCE_PIXMAP);
+    return 0;
+  }
+
+  cache->atlas = xcb_generate_id(xcon);
+  XCW_REQUEST(
+    xcb_render_create_picture,
+    xcon,
+    cache->atlas,
+    pixmap,
+    state->render.a8,
+    0,
+    NULL);
+  stats_created(RESOURCE_PICTURE);
+  XCW_REQUEST(xcb_free_pixmap, xcon, pixmap);
+  stats_freed(RESOURCE_PIXMAP);
+  return 1;
+}
+
+static xcb_render_picture_t
+create_pen(
+  xcb_connection_t* c,
+  render_context_t* render,
+  int red,
+  int green,
+  int blue,
+  int alpha)
+{
+  xcb_render_color_t color = {
+    .red = red, .green = green, .blue = blue, .alpha = alpha
+  };
+
+  xcb_pixmap_t pm = xcb_generate_id(c);
+  XCW_REQUEST(xcb_create_pixmap, c, 32, pm, render->screen->root, 1, 1);
+  stats_created(RESOURCE_PIXMAP);
+
+  uint32_t values[1];
+  values[0] = XCB_RENDER_REPEAT_NORMAL;
+
+  // alpha can only be used with a picture containing a pixmap
+  xcb_render_picture_t picture = xcb_generate_id(c);
+  XCW_REQUEST(
+    xcb_render_create_picture,
+    c,
+    picture,
+    pm,
+    render->argb32,
+    XCB_RENDER_CP_REPEAT,
+    values);
+  stats_created(RESOURCE_PICTURE);
+
+  xcb_rectangle_t rect = { .x = 0, .y = 0, .width = 1, .height = 1 };
+
+  XCW_REQUEST(
+    xcb_render_fill_rectangles,
+    c,
+    XCB_RENDER_PICT_OP_OVER,
+    picture,
+    color,
+    1,
+    &rect);
+
+  XCW_REQUEST(xcb_free_pixmap, c, pm);
+  stats_freed(RESOURCE_PIXMAP);
+  return picture;
+}
+
+/**
+ * Order glyph metrics by codepoint, for use with `qsort` and `bsearch`.
+ */
+int
+glyph_metrics_compare(const void* a, const void* b)
+{
+  FcChar32 ca = ((glyph_metrics_t*)a)->codepoint;
+  FcChar32 cb = ((glyph_metrics_t*)b)->codepoint;
+  return ca < cb ? -1 : ca > cb;
+}
+
+/**
+ * Find the metrics of a cached glyph.
+ *
+ * returns: the metrics, or NULL if `codepoint` isn't in the cache
+ */
+glyph_metrics_t*
+glyph_cache_metrics(glyph_cache_t* cache, FcChar32 codepoint)
+{
+  glyph_metrics_t key = { codepoint };
+  return bsearch(
+    &key,
+    cache->metrics,
+    cache->metrics_size,
+    sizeof(glyph_metrics_t),
+    glyph_metrics_compare);
+}
+
+/**
+ * Render text onto a picture from the atlas of the glyph cache, one glyph at a
+ * time.
+ *
+ * picture: picture to render onto
+ * x, y: location of the start of the text's baseline
+ * holder: codepoints to render
+ */
+void
+glyph_atlas_draw(
+  xcw_state_t* state,
+  xcb_render_picture_t picture,
+  int x,
+  int y,
+  struct utf_holder holder)
+{
+  glyph_cache_t* cache = state->glyphs;
+  for (int i = 0; i < holder.length; i++) {
+    glyph_metrics_t* metrics = glyph_cache_metrics(cache, holder.str[i]);
+    if (metrics == NULL)
+      continue;
+    // the atlas is the mask, so the glyph takes the text colour
+    XCW_REQUEST(
+      xcb_render_composite,
+      state->xcon,
+      XCB_RENDER_PICT_OP_OVER,
+      state->fg_pen,
+      cache->atlas,
+      picture,
+      0,
+      0,
+      0,
+      metrics->atlas_y,
+      x + metrics->left,
+      y - metrics->ascent,
+      metrics->width,
+      metrics->ascent + metrics->descent);
+    x += metrics->advance;
+  }
+}
+
+/**
+ * Release a glyph cache, including its server-side glyphset or atlas.  Does
+ * nothing if `cache` is NULL.
+ */
+void
+glyph_cache_free(xcw_state_t* state, glyph_cache_t* cache)
+{
+  if (cache == NULL)
+    return;
+  if (cache->glyphset != XCB_NONE) {
+    XCW_REQUEST(xcb_render_free_glyph_set, state->xcon, cache->glyphset);
+    stats_freed(RESOURCE_GLYPHSET);
+  }
+  if (cache->atlas != XCB_NONE) {
+    XCW_REQUEST(xcb_render_free_picture, state->xcon, cache->atlas);
+    stats_freed(RESOURCE_PICTURE);
+  }
+  xcw_free(HEAP_GLYPHS, cache->metrics);
+  if (state->glyphs == cache)
+    state->glyphs = NULL;
+  xcw_free(HEAP_GLYPHS, cache);
+}
+
+/**
+ * Start loading the label font's glyph for every character in the pool.  Glyphs
+ * saved by an earlier run are loaded from the glyph file; otherwise they're
+ * rasterised in another thread while the main thread carries on, until
+ * `glyph_cache_finish` is called.  Only one font is ever in use, so this
+ * replaces any previously loaded cache that doesn't match `font_path` and
+ * `font_size`.
+ *
+ * holder: codepoints to load
+ */
+void
+glyph_cache_start(
+  xcw_state_t* state,
+  char* font_path,
+  int font_size,
+  struct utf_holder holder)
+{
+  glyph_cache_t* cache = state->glyphs;
+  if (
+    cache != NULL && cache->font_size == font_size &&
+    strcmp(cache->font_path, font_path) == 0) {
+    return;
+  }
+  glyph_cache_free(state, cache);
+
+  cache = xcw_calloc(HEAP_GLYPHS, 1, sizeof(glyph_cache_t));
+  cache->font_path = font_path;
+  cache->font_size = font_size;
+  cache->glyphset = XCB_NONE;
+  cache->atlas = XCB_NONE;
+  glyph_job_t* job = xcw_calloc(HEAP_GLYPHS, 1, sizeof(glyph_job_t));
+  cache->job = job;
+  if (stat(font_path, &(job->font_stat)) != 0)
+    xcw_die("couldn't load font: %s\n", font_path);
+  // the thread reads the codepoints until it's done
+  job->codepoints.length = holder.length;
+  job->codepoints.str =
+    xcw_malloc(HEAP_GLYPHS, max(holder.length, 1) * sizeof(FcChar32));
+  memcpy(job->codepoints.str, holder.str, holder.length * sizeof(FcChar32));
+
+  // FreeType is only needed if the glyphs haven't been saved by an earlier run
+  job->saved = glyph_file_path(
+    font_path, font_size, holder, job->file_path, sizeof(job->file_path));
+  job->loaded = job->saved && glyph_file_load(job->file_path,
+                                              font_path,
+                                              &(job->font_stat),
+                                              font_size,
+                                              holder,
+                                              &(job->raster));
+  if (!job->loaded)
+    glyph_job_start(job, font_path, font_size);
+  state->pending_glyphs = cache;
+}
+
+/**
+ * Finish loading the glyph cache started by `glyph_cache_start`, and upload the
+ * glyphs in one batch.  Does nothing if there's no glyph cache being loaded.
+ * Sets `state->glyphs`.
+ */
+void
+glyph_cache_finish(xcw_state_t* state)
+{
+  glyph_cache_t* cache = state->pending_glyphs;
+  if (cache == NULL)
+    return;
+  glyph_job_t* job = cache->job;
+  glyph_raster_t* raster = &(job->raster);
+  if (!job->loaded) {
+    glyph_job_finish(job);
+    if (job->saved)
+      glyph_file_save(job->file_path,
+                      cache->font_path,
+                      &(job->font_stat),
+                      cache->font_size,
+                      raster);
+  }
+
+  // large images stay off the connection if the server is local
+  if (
+    raster->data_size < SHM_UPLOAD_MIN_BYTES ||
+    !glyph_atlas_upload(state, cache, raster)) {
+    cache->glyphset = xcb_generate_id(state->xcon);
+    XCW_REQUEST(
+      xcb_render_create_glyph_set,
+      state->xcon,
+      cache->glyphset,
+      state->render.a8);
+    stats_created(RESOURCE_GLYPHSET);
+    glyph_raster_upload(state->xcon, cache->glyphset, raster);
+  }
+
+  // the cache keeps the metrics
+  cache->metrics = raster->metrics;
+  cache->metrics_size = raster->size;
+  raster->metrics = NULL;
+  glyph_raster_free(raster);
+  xcw_free(HEAP_GLYPHS, job->codepoints.str);
+  xcw_free(HEAP_GLYPHS, job);
+  cache->job = NULL;
+
+  cache->ascent = 0;
+  cache->descent = 0;
+  for (int n = 0; n < cache->metrics_size; n++) {
+    cache->ascent = max(cache->ascent, cache->metrics[n].ascent);
+    cache->descent = max(cache->descent, cache->metrics[n].descent);
+  }
+  qsort(
+    cache->metrics,
+    cache->metrics_size,
+    sizeof(glyph_metrics_t),
+    glyph_metrics_compare);
+
+  state->glyphs = cache;
+  state->pending_glyphs = NULL;
+}
+
+/**
+ * Start loading the glyph cache for every character that may appear in a
+ * label.
+ */
+void
+glyph_cache_initialise(xcw_state_t* state)
+{
+  char* pool =
+    xcw_calloc(HEAP_GLYPHS, state->input->ksl_size + 1, sizeof(char));
+  for (int i = 0; i < state->input->ksl_size; i++)
+    pool[i] = state->input->ksl[i].character;
+  struct utf_holder holder = char_to_uint32(pool);
+  xcw_free(HEAP_GLYPHS, pool);
+
+  glyph_cache_start(
+    state, state->input->font_path, state->input->font_size, holder);
+  utf_holder_destroy(holder);
+}
+
+/**
+ * Open the core font used to render labels when no font file is given, and
+ * fetch its metrics so labels can be laid out without asking the server.
+ */
+void
+overlay_font_initialise(xcw_state_t* state)
+{
+  xcb_connection_t* xcon = state->xcon;
+  state->overlay_font = xcb_generate_id(xcon);
+  xcb_void_cookie_t ofc = XCW_REQUEST(
+    xcb_open_font,
+    xcon,
+    state->overlay_font,
+    strlen(OVERLAY_FONT_NAME),
+    OVERLAY_FONT_NAME);
+  xorg_track_request(&(state->requests), ofc, "open_font");
+  stats_created(RESOURCE_FONT);
+  xcb_query_font_cookie_t qfc = XCW_REQUEST(
+    xcb_query_font, xcon, state->overlay_font);
+  state->overlay_font_info =
+    XCW_REPLY(xcb_query_font_reply, xcon, qfc, NULL);
+  if (state->overlay_font_info == NULL) {
+    xcw_die("open_font %s\n", OVERLAY_FONT_NAME);
+  }
+}
+
+/**
+ * Set up whichever font labels are rendered with: the font file given by the
+ * user through FreeType, or else the core font `OVERLAY_FONT_NAME`.  A font
+ * file's glyphs are only ready once `glyph_cache_finish` is called.
+ */
+void
+initialise_label_font(xcw_state_t* state)
+{
+  if (state->input->font_path == NULL)
+    overlay_font_initialise(state);
+  else
+    glyph_cache_initialise(state);
+}
+
+/**
+ * Compute the size of a label's image.
+ *
+ * text: label text (null-terminated)
+ * width, height (output): size of the image
+ * baseline (output): distance from the top of the image to the text baseline
+ */
+void
+label_extents(
+  xcw_state_t* state,
+  char* text,
+  int* width,
+  int* height,
+  int* baseline)
+{
+  if (state->glyphs == NULL) {
+    xcb_query_font_reply_t* info = state->overlay_font_info;
+    xcb_charinfo_t* char_infos = xcb_query_font_char_infos(info);
+    int char_infos_size = xcb_query_font_char_infos_length(info);
+    int text_width = 0;
+    for (int i = 0; text[i] != '\0'; i++) {
+      int index = (unsigned char)text[i] - info->min_char_or_byte2;
+      if (index >= 0 && index < char_infos_size)
+        text_width += char_infos[index].character_width;
+      else
+        text_width += info->max_bounds.character_width;
+    }
+    *width = max(text_width, 1);
+    *height = max(info->font_ascent + info->font_descent, 1);
+    *baseline = info->font_ascent;
+    return;
+  }
+
+  glyph_cache_t* cache = state->glyphs;
+  struct utf_holder holder = char_to_uint32(text);
+  int pen = 0;
+  int right = 0;
+  for (int i = 0; i < holder.length; i++) {
+    glyph_metrics_t* metrics = glyph_cache_metrics(cache, holder.str[i]);
+    if (metrics == NULL)
+      continue;
+    // the glyph's image may extend past its advance
+    right = max(right, pen + metrics->left + metrics->width);
+    pen += metrics->advance;
+  }
+  utf_holder_destroy(holder);
+
+  *width = max(max(pen, right), 1);
+  *height = max(cache->ascent + cache->descent, 1);
+  *baseline = cache->ascent;
+}
+
+/**
+ * Place a label within a rectangle.
+ *
+ * anchor: point of `rect` the label is placed at
+ * rect: the area to place the label in
+ * width, height: size of the label
+ *
+ * returns: the area covered by the label
+ */
+xcb_rectangle_t
+label_place(
+  anchor_lookup_t* anchor,
+  xcb_rectangle_t* rect,
+  int width,
+  int height)
+{
+  xcb_rectangle_t result = { rect->x + (rect->width - width) * anchor->x / 2,
+                             rect->y + (rect->height - height) * anchor->y / 2,
+                             width,
+                             height };
+  return result;
+}
+
+/**
+ * Render text onto a picture using the label glyphs.
+ *
+ * picture: picture to render onto
+ * x, y: location of the start of the text's baseline
+ * text: text to render (null-terminated)
+ */
+void
+xorg_draw_text(
+  xcw_state_t* state,
+  xcb_render_picture_t picture,
+  int x,
+  int y,
+  char* text)
+{
+  struct utf_holder holder;
+  holder = char_to_uint32(text);
+  if (state->glyphs->atlas != XCB_NONE) {
+    glyph_atlas_draw(state, picture, x, y, holder);
+    utf_holder_destroy(holder);
+    return;
+  }
+  xcb_render_util_composite_text_stream_t* ts =
+    xcb_render_util_composite_text_stream(
+      state->glyphs->glyphset, holder.length, 0);
+
+  // draw the text (in holder) at certain positions
+  xcb_render_util_glyphs_32(
+    ts,
+    x,             // dx
+    y,             // dy
+    holder.length, //
+    holder.str);
+
+  XCW_REQUEST(xcb_render_util_composite_text,
+              state->xcon,             // connection
+              XCB_RENDER_PICT_OP_OVER, // op
+              state->fg_pen,           // src
+              picture,                 // dst
+              0,                       // fmt
+              0,                       // src x
+              0,                       // src y
+              ts);                     // txt stream
+  xcb_render_util_composite_text_free(ts);
+  utf_holder_destroy(holder);
+}
+
+/**
+ * Get the class name from a reply to `xcb_icccm_get_wm_class`.
+ *
+ * returns: the class (to be freed by the caller), or NULL if the window doesn't
+ *     set one
+ */
+char*
+icccm_window_class(xcw_state_t* state, xcb_get_property_cookie_t cookie)
+{
+  xcb_icccm_get_wm_class_reply_t prop;
+  timings_wait(cookie.sequence);
+  if (!xcb_icccm_get_wm_class_reply(state->xcon, cookie, &prop, NULL))
+    return NULL;
+  char* window_class = xcw_strdup(HEAP_WINDOWS, prop.class_name);
+  xcb_icccm_get_wm_class_reply_wipe(&prop);
+  return window_class;
+}
+
+/**
+ * Get all windows from the X server.
+ *
+ * windows (output): window IDs
+ * windows_size (output): size of `windows`
+ */
+void
+xorg_get_windows(xcw_state_t* state, xcb_window_t** windows, int* windows_size)
+{
+  xcb_query_tree_cookie_t qtc = XCW_REQUEST(
+    xcb_query_tree, state->xcon, state->xroot);
+  xcb_query_tree_reply_t* qtr;
+  if (!(qtr = XCW_REPLY(xcb_query_tree_reply, state->xcon, qtc, NULL))) {
+    xcw_die("query_tree\n");
+  }
+  xcb_window_t* referenced_windows = xcb_query_tree_children(qtr);
+  int size = xcb_query_tree_children_length(qtr);
+
+  // copy for easier usage
+  *windows = xcw_calloc(HEAP_WINDOWS, size, sizeof(xcb_window_t));
+  for (int i = 0; i < size; i++)
+    (*windows)[i] = referenced_windows[i];
+  free(qtr);
+
+  *windows_size = size;
+}
+
+/**
+ * Get windows managed by the window manager.
+ *
+ * is_defined (output): whether the window manager defines the windows it
+ *     tracks; if 0, `windows` and `windows_size` will not be set
+ * windows (output): window IDs
+ * windows_size (output): size of `windows`
+ */
+void
+xorg_get_managed_windows(
+  xcw_state_t* state,
+  int* is_defined,
+  xcb_window_t** windows,
+  int* windows_size)
+{
+  // read in chunks until the server says there's nothing left; the first
+  // chunk usually covers the whole list
+  xcb_window_t* result = NULL;
+  int size = 0;
+  uint32_t length = MAX_WINDOWS;
+  int more = 1;
+  while (more) {
+    xcb_get_property_cookie_t gpc = (XCW_REQUEST(
+      xcb_get_property,
+      state->xcon,
+      0,
+      state->xroot,
+      state->ewmh._NET_CLIENT_LIST,
+      XCB_ATOM_WINDOW,
+      size, // offset in 4-byte units, and each window ID is 4 bytes
+      length));
+    xcb_get_property_reply_t* gpr;
+    if (!(gpr = XCW_REPLY(xcb_get_property_reply, state->xcon, gpc, NULL))) {
+      xcw_die("get_property _NET_CLIENT_LIST\n");
+    }
+
+    if (size == 0 && gpr->type == XCB_NONE) {
+      // property isn't defined
+      free(gpr);
+      *is_defined = 0;
+      return;
+    }
+
+    xcb_window_t* referenced_windows =
+      ((xcb_window_t*)xcb_get_property_value(gpr));
+    int chunk_size = xcb_get_property_value_length(gpr) / 4;
+
+    // copy for easier usage
+    result = xcw_realloc(
+      HEAP_WINDOWS, result, (size + chunk_size) * sizeof(xcb_window_t));
+    for (int i = 0; i < chunk_size; i++)
+      result[size + i] = referenced_windows[i];
+    size += chunk_size;
+
+    // if the type doesn't match, no value is returned at all
+    more = (gpr->type == XCB_ATOM_WINDOW && chunk_size > 0 &&
+            gpr->bytes_after > 0);
+    length = (gpr->bytes_after + 3) / 4;
+    free(gpr);
+  }
+
+  *is_defined = 1;
+  *windows = result;
+  *windows_size = size;
+}
+
+/**
+ * Look up the rendering details of the X server.
+ *
+ * screen: the screen that overlays are created on
+ * render (output): the result
+ */
+void
+render_context_initialise(
+  xcb_connection_t* xcon,
+  xcb_screen_t* screen,
+  render_context_t* render)
+{
+  // both requests are sent together the first time, and cached
+  timings_round_trip();
+  const xcb_render_query_version_reply_t* version =
+    xcb_render_util_query_version(xcon);
+  if (version == NULL)
+    xcw_die("the X server doesn't support the Render extension\n");
+  const xcb_render_query_pict_formats_reply_t* formats =
+    xcb_render_util_query_formats(xcon);
+  if (formats == NULL)
+    xcw_die("query_pict_formats\n");
+
+  xcb_render_pictforminfo_t* argb32 =
+    xcb_render_util_find_standard_format(formats, XCB_PICT_STANDARD_ARGB_32);
+  xcb_render_pictforminfo_t* a8 =
+    xcb_render_util_find_standard_format(formats, XCB_PICT_STANDARD_A_8);
+  xcb_render_pictforminfo_t* rgb24 =
+    xcb_render_util_find_standard_format(formats, XCB_PICT_STANDARD_RGB_24);
+  xcb_render_pictvisual_t* root_visual =
+    xcb_render_util_find_visual_format(formats, screen->root_visual);
+  if (argb32 == NULL || a8 == NULL || rgb24 == NULL || root_visual == NULL)
+    xcw_die("missing XRender picture formats\n");
+
+  render->screen = screen;
+  render->version_major = version->major_version;
+  render->version_minor = version->minor_version;
+  render->argb32 = argb32->id;
+  render->a8 = a8->id;
+  render->rgb24 = rgb24->id;
+  render->root_format = root_visual->format;
+}
+
+/**
+ * Choose the visual for overlay windows.  When a compositor is running, a
+ * 32-bit ARGB visual lets overlays have a translucent background, and lets
+ * them be drawn with XRender directly instead of through a pixmap.  Otherwise,
+ * or if the server has no ARGB visual, overlays use the root visual.  The
+ * choice is made once, so a daemon keeps it if a compositor starts or stops.
+ *
+ * composited: whether a compositor is running
+ * render: must already be initialised by `render_context_initialise`
+ */
+void
+render_overlay_visual_initialise(
+  xcb_connection_t* xcon,
+  int composited,
+  render_context_t* render)
+{
+  xcb_screen_t* screen = render->screen;
+  render->overlay_argb = 0;
+  render->overlay_visual = screen->root_visual;
+  render->overlay_depth = screen->root_depth;
+  render->overlay_colormap = XCB_COPY_FROM_PARENT;
+  render->overlay_format = render->root_format;
+  render->overlay_bg = BG_COLOUR;
+  if (!composited)
+    return;
+
+  // cached by `render_context_initialise`
+  const xcb_render_query_pict_formats_reply_t* formats =
+    xcb_render_util_query_formats(xcon);
+  xcb_visualid_t visual = XCB_NONE;
+  xcb_depth_iterator_t di = xcb_screen_allowed_depths_iterator(screen);
+  for (; di.rem > 0 && visual == XCB_NONE; xcb_depth_next(&di)) {
+    if (di.data->depth != 32)
+      continue;
+    xcb_visualtype_iterator_t vi = xcb_depth_visuals_iterator(di.data);
+    for (; vi.rem > 0; xcb_visualtype_next(&vi)) {
+      xcb_render_pictvisual_t* pictvisual =
+        xcb_render_util_find_visual_format(formats, vi.data->visual_id);
+      if (
+        vi.data->_class == XCB_VISUAL_CLASS_TRUE_COLOR && pictvisual != NULL &&
+        pictvisual->format == render->argb32) {
+        visual = vi.data->visual_id;
+        break;
+      }
+    }
+  }
+  if (visual == XCB_NONE) {
+    xcw_warn("no ARGB visual, using opaque overlay windows\n");
+    return;
+  }
+
+  render->overlay_colormap = xcb_generate_id(xcon);
+  XCW_REQUEST(
+    xcb_create_colormap,
+    xcon,
+    XCB_COLORMAP_ALLOC_NONE,
+    render->overlay_colormap,
+    screen->root,
+    visual);
+  stats_created(RESOURCE_COLORMAP);
+  render->overlay_argb = 1;
+  render->overlay_visual = visual;
+  render->overlay_depth = 32;
+  render->overlay_format = render->argb32;
+  render->overlay_bg = TRANSLUCENT_BG_COLOUR;
+}
+
+/**
+ * Initialise the connection to the X server.
+ *
+ * state (output): pointer to program state; `input` and `wsetups` are not
+ *     initialised
+ */
+void
+initialise_xorg(xcw_state_t** state)
+{
+  int default_screen;
+  xcb_screen_t* screen = NULL;
+  xcb_connection_t* xcon = xcb_connect(NULL, &default_screen);
+  if (xcb_connection_has_error(xcon))
+    xcw_die("connect\n");
+  // answered along with the atoms below, instead of on first use
+  xcb_prefetch_extension_data(xcon, &xcb_randr_id);
+  xcb_prefetch_extension_data(xcon, &xcb_shape_id);
+  xcb_prefetch_extension_data(xcon, &xcb_shm_id);
+
+  // the screen named by $DISPLAY
+  xcb_screen_iterator_t si = xcb_setup_roots_iterator(xcb_get_setup(xcon));
+  for (int i = 0; si.rem > 0; i++, xcb_screen_next(&si)) {
+    if (i == default_screen)
+      screen = si.data;
+  }
+  if (screen == NULL)
+    xcw_die("no screens\n");
+  xcb_window_t xroot = screen->root;
+
+  xcb_ewmh_connection_t ewmh;
+  xcb_intern_atom_cookie_t* ewmhc = XCW_REQUEST(
+    xcb_ewmh_init_atoms, xcon, &ewmh);
+  timings_wait(ewmhc[0].sequence);
+  if (!xcb_ewmh_init_atoms_replies(&ewmh, ewmhc, NULL)) {
+    xcw_die("ewmh init\n");
+  }
+
+  xcb_key_symbols_t* ksymbols;
+  ksymbols = xcb_key_symbols_alloc(xcon);
+  if (ksymbols == NULL)
+    xcw_die("key_symbols_alloc\n");
+
+  // answered along with the Render queries
+  xcb_get_selection_owner_cookie_t cmc =
+    XCW_REQUEST(xcb_ewmh_get_wm_cm_owner, &ewmh, default_screen);
+  render_context_t render;
+  render_context_initialise(xcon, screen, &render);
+  xcb_window_t cm_owner = XCB_NONE;
+  if (!xcb_ewmh_get_wm_cm_owner_reply(&ewmh, cmc, &cm_owner, NULL))
+    cm_owner = XCB_NONE;
+  render_overlay_visual_initialise(xcon, cm_owner != XCB_NONE, &render);
+  xcb_render_picture_t fg_pen =
+    create_pen(xcon, &render, 0x0f00, 0xff00, 0x0f00, 0xf000);
+
+  *state = xcw_malloc(HEAP_OTHER, sizeof(xcw_state_t));
+  xcw_state_t local_state = { xcon,
+                              xroot,
+                              ewmh,
+                              ksymbols,
+                              render,
+                              XCB_NONE,
+                              NULL,
+                              NULL,
+                              NULL,
+                              { NULL, 0, 0 },
+                              NULL,
+                              0,
+                              xid_table_create(0),
+                              fg_pen,
+                              NULL,
+                              0,
+                              { NULL, NULL, 0 },
+                              -1,
+                              -1,
+                              NULL,
+                              { NULL, NULL, 0 },
+                              NULL,
+                              NULL,
+                              0,
+                              { 0, { 0 }, 0, 0, -1, 0 },
+                              NULL,
+                              0,
+                              ALL_DESKTOPS,
+                              NULL,
+                              NULL,
+                              0,
+                              0 };
+  **state = local_state;
+  (*state)->requests.sequences = xcw_calloc(
+    HEAP_OTHER, REQUEST_LOG_SIZE, sizeof(*(*state)->requests.sequences));
+  (*state)->requests.names =
+    xcw_calloc(HEAP_OTHER, REQUEST_LOG_SIZE, sizeof(*(*state)->requests.names));
+}
+
+/**
+ * Find the area covered by each monitor, using RandR if the server supports
+ * monitors (RandR 1.5), or else treating the screen as a single monitor.
+ */
+void
+monitors_initialise(xcw_state_t* state)
+{
+  xcb_connection_t* xcon = state->xcon;
+  xcw_free(HEAP_OTHER, state->monitors);
+  state->monitors = NULL;
+  state->monitors_size = 0;
+
+  const xcb_query_extension_reply_t* randr =
+    xcb_get_extension_data(xcon, &xcb_randr_id);
+  if (randr != NULL && randr->present) {
+    // an old server answers get_monitors with an error, so ask for both at once
+    xcb_randr_query_version_cookie_t qvc = XCW_REQUEST(
+      xcb_randr_query_version, xcon, 1, 5);
+    xcb_randr_get_monitors_cookie_t gmc =
+      XCW_REQUEST(xcb_randr_get_monitors, xcon, state->xroot, 1);
+    xcb_randr_query_version_reply_t* qvr =
+      XCW_REPLY(xcb_randr_query_version_reply, xcon, qvc, NULL);
+    xcb_randr_get_monitors_reply_t* gmr =
+      XCW_REPLY(xcb_randr_get_monitors_reply, xcon, gmc, NULL);
+
+    if (
+      qvr != NULL && gmr != NULL &&
+      (qvr->major_version > 1 ||
+       (qvr->major_version == 1 && qvr->minor_version >= 5))) {
+      state->monitors =
+        xcw_calloc(HEAP_OTHER, max(gmr->nMonitors, 1), sizeof(xcb_rectangle_t));
+      xcb_randr_monitor_info_iterator_t mi =
+        xcb_randr_get_monitors_monitors_iterator(gmr);
+      for (; mi.rem > 0; xcb_randr_monitor_info_next(&mi)) {
+        xcb_rectangle_t rect = {
+          mi.data->x, mi.data->y, mi.data->width, mi.data->height
+        };
+        state->monitors[state->monitors_size] = rect;
+        state->monitors_size += 1;
+      }
+    }
+    free(qvr);
+    free(gmr);
+  }
+
+  if (state->monitors_size == 0) {
+    xcb_screen_t* screen = state->render.screen;
+    xcb_rectangle_t rect = {
+      0, 0, screen->width_in_pixels, screen->height_in_pixels
+    };
+    xcw_free(HEAP_OTHER, state->monitors);
+    state->monitors = xcw_malloc(HEAP_OTHER, sizeof(xcb_rectangle_t));
+    state->monitors[0] = rect;
+    state->monitors_size = 1;
+  }
+}
+
+/**
+ * Ask to be told when the monitor layout changes, so that a daemon can call
+ * `monitors_initialise` again.
+ */
+void
+monitors_watch(xcw_state_t* state)
+{
+  const xcb_query_extension_reply_t* randr =
+    xcb_get_extension_data(state->xcon, &xcb_randr_id);
+  if (randr != NULL && randr->present)
+    XCW_REQUEST(
+      xcb_randr_select_input,
+      state->xcon,
+      state->xroot,
+      XCB_RANDR_NOTIFY_MASK_SCREEN_CHANGE);
+}
+
+/**
+ * Determine whether an event says the monitor layout changed.
+ */
+int
+monitors_changed(xcw_state_t* state, xcb_generic_event_t* event)
+{
+  const xcb_query_extension_reply_t* randr =
+    xcb_get_extension_data(state->xcon, &xcb_randr_id);
+  return (
+    randr != NULL && randr->present &&
+    (event->response_type & ~0x80) ==
+      randr->first_event + XCB_RANDR_SCREEN_CHANGE_NOTIFY);
+}
+
+/**
+ * Reduce a rectangle to the part of it on the monitor showing most of it.
+ *
+ * rect: rectangle to reduce, in place
+ *
+ * returns: whether any of the rectangle is on a monitor (if not, `rect` is
+ *     unchanged)
+ */
+int
+monitors_clip(xcw_state_t* state, xcb_rectangle_t* rect)
+{
+  xcb_rectangle_t best;
+  int best_area = 0;
+  for (int i = 0; i < state->monitors_size; i++) {
+    xcb_rectangle_t visible;
+    if (!rect_intersect(rect, &(state->monitors[i]), &visible))
+      continue;
+    int area = visible.width * visible.height;
+    if (area > best_area) {
+      best = visible;
+      best_area = area;
+    }
+  }
+  if (best_area == 0)
+    return 0;
+  *rect = best;
+  return 1;
+}
+
+// -- window classification
+
+/**
+ * Order `atom_bits_t` items by atom, for use with `qsort` and `bsearch`.
+ */
+int
+atom_bits_compare(const void* a, const void* b)
+{
+  xcb_atom_t aa = ((atom_bits_t*)a)->atom;
+  xcb_atom_t ab = ((atom_bits_t*)b)->atom;
+  return aa < ab ? -1 : aa > ab;
+}
+
+/**
+ * Build `state->atom_bits`, so that windows can be classified without
+ * comparing against each EWMH atom in turn.
+ */
+void
+window_atoms_initialise(xcw_state_t* state)
+{
+  xcb_ewmh_connection_t* ewmh = &(state->ewmh);
+  atom_bits_t atom_bits[] = {
+    { ewmh->_NET_WM_WINDOW_TYPE_NORMAL, ATOM_TYPE_NORMAL },
+    { ewmh->_NET_WM_WINDOW_TYPE_DIALOG, ATOM_TYPE_NORMAL },
+    { ewmh->_NET_WM_WINDOW_TYPE_UTILITY, ATOM_TYPE_NORMAL },
+    { ewmh->_NET_WM_WINDOW_TYPE_TOOLBAR, ATOM_TYPE_NORMAL },
+    { ewmh->_NET_WM_WINDOW_TYPE_MENU, ATOM_TYPE_NORMAL },
+    { ewmh->_NET_WM_WINDOW_TYPE_SPLASH, ATOM_TYPE_NORMAL },
+    { ewmh->_NET_WM_WINDOW_TYPE_DESKTOP, ATOM_TYPE_OTHER },
+    { ewmh->_NET_WM_WINDOW_TYPE_DOCK, ATOM_TYPE_OTHER },
+    { ewmh->_NET_WM_WINDOW_TYPE_DROPDOWN_MENU, ATOM_TYPE_OTHER },
+    { ewmh->_NET_WM_WINDOW_TYPE_POPUP_MENU, ATOM_TYPE_OTHER },
+    { ewmh->_NET_WM_WINDOW_TYPE_TOOLTIP, ATOM_TYPE_OTHER },
+    { ewmh->_NET_WM_WINDOW_TYPE_NOTIFICATION, ATOM_TYPE_OTHER },
+    { ewmh->_NET_WM_WINDOW_TYPE_COMBO, ATOM_TYPE_OTHER },
+    { ewmh->_NET_WM_WINDOW_TYPE_DND, ATOM_TYPE_OTHER },
+    { ewmh->_NET_WM_STATE_HIDDEN, ATOM_STATE_HIDDEN },
+    { ewmh->_NET_WM_STATE_SKIP_TASKBAR, ATOM_STATE_HIDDEN }
+  };
+  state->atom_bits_size = sizeof(atom_bits) / sizeof(*atom_bits);
+  state->atom_bits = xcw_malloc(HEAP_OTHER, sizeof(atom_bits));
+  memcpy(state->atom_bits, atom_bits, sizeof(atom_bits));
+  qsort(state->atom_bits,
+        state->atom_bits_size,
+        sizeof(atom_bits_t),
+        atom_bits_compare);
+}
+
+/**
+ * returns: the `ATOM_*` flags for an atom (0 if it means nothing here)
+ */
+uint32_t
+window_atom_bits(xcw_state_t* state, xcb_atom_t atom)
+{
+  atom_bits_t key = { atom, 0 };
+  atom_bits_t* found = bsearch(&key,
+                               state->atom_bits,
+                               state->atom_bits_size,
+                               sizeof(atom_bits_t),
+                               atom_bits_compare);
+  return found == NULL ? 0 : found->bits;
+}
+
+/**
+ * Request everything `window_query_reply` needs to classify a window, without
+ * waiting for the replies.
+ */
+window_query_t
+window_query(xcw_state_t* state, xcb_window_t window)
+{
+  xcb_connection_t* xcon = state->xcon;
+  xcb_ewmh_connection_t* ewmh = &(state->ewmh);
+  window_query_t query = {
+    XCW_REQUEST(xcb_get_window_attributes, xcon, window),
+    XCW_REQUEST(xcb_get_property, xcon,
+                     0,
+                     window,
+                     ewmh->_NET_WM_WINDOW_TYPE,
+                     XCB_ATOM_ATOM,
+                     0,
+                     MAX_PROPERTY_ATOMS),
+    XCW_REQUEST(xcb_get_property, xcon,
+                     0,
+                     window,
+                     ewmh->_NET_WM_STATE,
+                     XCB_ATOM_ATOM,
+                     0,
+                     MAX_PROPERTY_ATOMS),
+    XCW_REQUEST(xcb_get_property,
+      xcon, 0, window, ewmh->_NET_WM_DESKTOP, XCB_ATOM_CARDINAL, 0, 1)
+  };
+  return query;
+}
+
+/**
+ * Classify a window from the replies to the requests made by `window_query`.
+ *
+ * Only the first window type this program knows is used, as EWMH lists them
+ * in order of preference; a window without one is normal.  A window is hidden
+ * if it's minimised or asks to be left out of taskbars.
+ */
+window_info_t
+window_query_reply(xcw_state_t* state, window_query_t* query)
+{
+  xcb_connection_t* xcon = state->xcon;
+  xcb_get_window_attributes_reply_t* gwar =
+    XCW_REPLY(xcb_get_window_attributes_reply, xcon, query->attributes, NULL);
+  xcb_get_property_reply_t* tgpr =
+    XCW_REPLY(xcb_get_property_reply, xcon, query->type, NULL);
+  xcb_get_property_reply_t* sgpr =
+    XCW_REPLY(xcb_get_property_reply, xcon, query->wm_state, NULL);
+  xcb_get_property_reply_t* dgpr =
+    XCW_REPLY(xcb_get_property_reply, xcon, query->desktop, NULL);
+
+  window_info_t info = { 0, 0, 0, 1, 0, ALL_DESKTOPS };
+  if (gwar != NULL && tgpr != NULL && sgpr != NULL && dgpr != NULL) {
+    info.exists = 1;
+    info.map_state = gwar->map_state;
+    info.override_redirect = gwar->override_redirect;
+
+    xcb_atom_t* types = xcb_get_property_value(tgpr);
+    int types_size = xcb_get_property_value_length(tgpr) / 4;
+    for (int i = 0; i < types_size; i++) {
+      uint32_t bits = window_atom_bits(state, types[i]);
+      if (bits & (ATOM_TYPE_NORMAL | ATOM_TYPE_OTHER)) {
+        info.type_normal = (bits & ATOM_TYPE_NORMAL) != 0;
+        break;
+      }
+    }
+
+    xcb_atom_t* wm_states = xcb_get_property_value(sgpr);
+    int wm_states_size = xcb_get_property_value_length(sgpr) / 4;
+    for (int i = 0; i < wm_states_size; i++) {
+      if (window_atom_bits(state, wm_states[i]) & ATOM_STATE_HIDDEN)
+        info.hidden = 1;
+    }
+
+    if (xcb_get_property_value_length(dgpr) == 4)
+      info.desktop = *(uint32_t*)xcb_get_property_value(dgpr);
+  }
+
+  free(gwar);
+  free(tgpr);
+  free(sgpr);
+  free(dgpr);
+  return info;
+}
+
+/**
+ * Request the EWMH current desktop, for use with `current_desktop_reply`.
+ */
+xcb_get_property_cookie_t
+current_desktop_request(xcw_state_t* state)
+{
+  return XCW_REQUEST(
+    xcb_get_property,
+    state->xcon,
+    0,
+    state->xroot,
+    state->ewmh._NET_CURRENT_DESKTOP,
+    XCB_ATOM_CARDINAL,
+    0,
+    1);
+}
+
+/**
+ * Set `state->current_desktop` from the reply to `current_desktop_request`.
+ */
+void
+current_desktop_reply(xcw_state_t* state, xcb_get_property_cookie_t cookie)
+{
+  xcb_get_property_reply_t* gpr =
+    XCW_REPLY(xcb_get_property_reply, state->xcon, cookie, NULL);
+  state->current_desktop = ALL_DESKTOPS;
+  if (gpr != NULL && xcb_get_property_value_length(gpr) == 4)
+    state->current_desktop = *(uint32_t*)xcb_get_property_value(gpr);
+  free(gpr);
+}
+
+/**
+ * Determine whether a window on an EWMH desktop is on the current desktop.
+ * Every window is if the window manager doesn't use desktops.
+ */
+int
+window_desktop_current(xcw_state_t* state, uint32_t desktop)
+{
+  return desktop == ALL_DESKTOPS || state->current_desktop == ALL_DESKTOPS ||
+         desktop == state->current_desktop;
+}
+
+/**
+ * Determine whether a classified window gets a label: it must be visible, not
+ * override-redirect, of a normal type, not hidden and on the current desktop.
+ */
+int
+window_info_normal(xcw_state_t* state, window_info_t* info)
+{
+  return (info->exists && info->map_state == XCB_MAP_STATE_VIEWABLE &&
+          !info->override_redirect && info->type_normal && !info->hidden &&
+          window_desktop_current(state, info->desktop));
+}
+
+// -- input handling
+
+/**
+ * Build `state->keycode_ksl`, so that a keypress can be turned into an index in
+ * `input->ksl` without any searching.  Keys are looked up without modifiers,
+ * as typed characters are always lowercase letters or digits.  Must be called
+ * again when the keyboard mapping changes.
+ */
+void
+input_keymap_initialise(xcw_state_t* state)
+{
+  if (state->keycode_ksl == NULL)
+    state->keycode_ksl = xcw_malloc(HEAP_OTHER, KEYCODES_SIZE * sizeof(int));
+  for (int i = 0; i < KEYCODES_SIZE; i++)
+    state->keycode_ksl[i] = -1;
+
+  // the keyboard mapping is fetched by the first lookup
+  timings_round_trip();
+  const xcb_setup_t* setup = xcb_get_setup(state->xcon);
+  for (int kc = setup->min_keycode; kc <= setup->max_keycode; kc++) {
+    xcb_keysym_t ksym = xcb_key_symbols_get_keysym(state->ksymbols, kc, 0);
+    for (int i = 0; i < state->input->ksl_size; i++) {
+      if (state->input->ksl[i].keysym == ksym) {
+        state->keycode_ksl[kc] = i;
+        break;
+      }
+    }
+    for (int i = 0; i < END_KEYSYMS_SIZE; i++) {
+      if (state->keycode_ksl[kc] < 0 && END_KEYSYMS[i] == ksym)
+        state->keycode_ksl[kc] = KEYCODE_END;
+    }
+  }
+}
+
+void
+session_end(xcw_state_t* state, xcb_window_t window);
+void
+session_output(xcw_state_t* state, xcb_window_t window);
+
+/**
+ * Ask for a keyboard grab on the root window.  The reply is handled by
+ * `input_grab_update`.
+ */
+void
+input_grab_request(xcw_state_t* state)
+{
+  state->grab.cookie = XCW_REQUEST(
+    xcb_grab_keyboard,
+    state->xcon,
+    0,
+    state->xroot,
+    XCB_CURRENT_TIME,
+    XCB_GRAB_MODE_ASYNC,
+    XCB_GRAB_MODE_ASYNC);
+  state->grab.pending = 1;
+  state->grab.retry_at = -1;
+}
+
+/**
+ * Start acquiring a Xorg keyboard grab on the root window.  This doesn't wait
+ * for the grab, so windows can be found and labels drawn in the meantime; the
+ * event loop finishes acquiring it through `input_grab_update`.
+ */
+void
+initialise_input(xcw_state_t* state)
+{
+  keyboard_grab_t grab = { 0, { 0 }, 0, monotonic_ms(), -1, GRAB_FIRST_DELAY };
+  state->grab = grab;
+  input_grab_request(state);
+}
+
+/**
+ * Make progress acquiring the keyboard grab, without blocking.  This handles
+ * the reply to the last request if it has arrived, and makes the next request
+ * if it is due.
+ *
+ * This program is likely to be launched from a hotkey daemon, which may still
+ * hold the keyboard, so the grab is retried with increasing delays until
+ * `GRAB_TIMEOUT` passes.  After that, a daemon gives up on the session, and
+ * otherwise the process exits.
+ */
+void
+input_grab_update(xcw_state_t* state)
+{
+  keyboard_grab_t* grab = &(state->grab);
+  int64_t now = monotonic_ms();
+  if (grab->retry_at >= 0 && now >= grab->retry_at)
+    input_grab_request(state);
+  if (!grab->pending)
+    return;
+
+  xcb_grab_keyboard_reply_t* gkr = NULL;
+  xcb_generic_error_t* error = NULL;
+  if (!xcb_poll_for_reply(
+        state->xcon, grab->cookie.sequence, (void**)&gkr, &error))
+    return;
+  grab->pending = 0;
+  if (gkr == NULL) {
+    free(error);
+    xcw_die("grab_keyboard\n");
+  }
+
+  int status = gkr->status;
+  free(gkr);
+  if (status == XCB_GRAB_STATUS_SUCCESS) {
+    grab->grabbed = 1;
+  } else if (status != XCB_GRAB_STATUS_ALREADY_GRABBED) {
+    xcw_die("grab_keyboard: %d\n", status);
+  } else if (now + grab->delay - grab->started <= GRAB_TIMEOUT) {
+    grab->retry_at = now + grab->delay;
+    grab->delay = min(grab->delay * 2, GRAB_MAX_DELAY);
+  } else if (state->listen_fd < 0) {
+    xcw_die("grab_keyboard: already grabbed\n");
+  } else {
+    fprintf(stderr, "grab_keyboard: already grabbed\n");
+    session_end(state, XCB_NONE);
+  }
+}
+
+/**
+ * returns: time until the next keyboard grab request is due, in milliseconds,
+ *     or -1 if none is
+ */
+int
+input_grab_timeout(xcw_state_t* state)
+{
+  if (state->grab.retry_at < 0)
+    return -1;
+  return max(state->grab.retry_at - monotonic_ms(), 0);
+}
+
+/**
+ * Release the keyboard grab, or stop acquiring it.
+ */
+void
+input_grab_release(xcw_state_t* state)
+{
+  if (state->grab.pending)
+    xcb_discard_reply(state->xcon, state->grab.cookie.sequence);
+  // a grab request still on its way is processed before this
+  XCW_REQUEST(xcb_ungrab_keyboard, state->xcon, XCB_CURRENT_TIME);
+  keyboard_grab_t none = { 0, { 0 }, 0, 0, -1, 0 };
+  state->grab = none;
+}
+
+// -- wsetup arena
+
+/**
+ * Allocate the arena holding every setup structure.  Every structure in
+ * the tree other than a leaf has at least two children, so a tree with
+ * `windows_size` leaves has fewer than `2 * windows_size` structures.
+ *
+ * windows_size: number of windows that will be tracked
+ */
+void
+wsetup_arena_initialise(wsetup_arena_t* arena, int windows_size)
+{
+  arena->capacity = max(2 * windows_size - 1, 1);
+  arena->nodes =
+    xcw_calloc(HEAP_LABELS, arena->capacity, sizeof(window_setup_t));
+  arena->size = 0;
+}
+
+/**
+ * Take contiguous setup structures from the arena.
+ *
+ * n: number of structures to take
+ *
+ * returns: index of the first structure
+ */
+int
+wsetup_arena_take(wsetup_arena_t* arena, int n)
+{
+  if (arena->size + n > arena->capacity)
+    xcw_die("wsetup arena exhausted\n");
+  int index = arena->size;
+  arena->size += n;
+  return index;
+}
+
+/**
+ * Free the arena and every setup structure in it.  Overlay windows must already
+ * have been destroyed.
+ */
+void
+wsetup_arena_free(wsetup_arena_t* arena)
+{
+  xcw_free(HEAP_LABELS, arena->nodes);
+  arena->nodes = NULL;
+  arena->size = 0;
+  arena->capacity = 0;
+}
+
+/**
+ * Get the children of a setup structure.
+ *
+ * returns: the first child, followed by the rest (NULL if there are none)
+ */
+window_setup_t*
+wsetup_children(xcw_state_t* state, window_setup_t* wsetup)
+{
+  if (wsetup->children < 0)
+    return NULL;
+  return &(state->wsetup_arena.nodes[wsetup->children]);
+}
+
+// -- overlay windows
+
+/**
+ * Create an overlay window.
+ *
+ * x, y: absolute screen location
+ * w, h: window size
+ */
+xcb_window_t
+overlay_create(xcw_state_t* state, int x, int y, int w, int h)
+{
+  render_context_t* render = &(state->render);
+  xcb_window_t win = xcb_generate_id(state->xcon);
+  // a border pixel and colormap are needed when the depth isn't the root's
+  uint32_t mask =
+    (XCB_CW_BACK_PIXEL | XCB_CW_BORDER_PIXEL | XCB_CW_OVERRIDE_REDIRECT |
+     XCB_CW_SAVE_UNDER | XCB_CW_EVENT_MASK | XCB_CW_COLORMAP);
+  // a compositor keeps the contents underneath anyway
+  uint32_t values[] = { argb_premultiply(render->overlay_bg),
+                        0,
+                        1,
+                        !render->overlay_argb,
+                        XCB_EVENT_MASK_EXPOSURE | XCB_EVENT_MASK_KEY_PRESS,
+                        render->overlay_colormap };
+  xcb_void_cookie_t cwc = XCW_REQUEST(
+    xcb_create_window,
+    state->xcon,
+    render->overlay_depth,
+    win,
+    state->xroot,
+    0,
+    0,
+    1,
+    1,
+    0,
+    XCB_WINDOW_CLASS_INPUT_OUTPUT,
+    render->overlay_visual,
+    mask,
+    values);
+  xorg_track_request(&(state->requests), cwc, "create_window");
+  stats_created(RESOURCE_WINDOW);
+
+  XCW_REQUEST(
+    xcb_icccm_set_wm_class,
+    state->xcon,
+    win,
+    sizeof(OVERLAY_WINDOW_CLASS),
+    OVERLAY_WINDOW_CLASS);
+  xorg_window_move_resize(state->xcon, win, x, y, w, h);
+  xcb_void_cookie_t mwc = XCW_REQUEST(xcb_map_window, state->xcon, win);
+  xorg_track_request(&(state->requests), mwc, "map_window");
+  return win;
+}
+
+/**
+ * Create a graphics context for drawing the background of an overlay window.
+ *
+ * win: the overlay window
+ */
+xcb_gcontext_t
+overlay_get_bg_gc(xcw_state_t* state, xcb_window_t win)
+{
+  xcb_gcontext_t gc = xcb_generate_id(state->xcon);
+  uint32_t mask = XCB_GC_FOREGROUND;
+  uint32_t value_list[] = { argb_premultiply(state->render.overlay_bg) };
+  xcb_void_cookie_t cgc =
+    (XCW_REQUEST(xcb_create_gc, state->xcon, gc, win, mask, value_list));
+  xorg_track_request(&(state->requests), cgc, "create_gc");
+  stats_created(RESOURCE_GC);
+  return gc;
+}
+
+/**
+ * Create a graphics context for drawing the text of an overlay window with the
+ * core font.
+ *
+ * win: the overlay window
+ */
+xcb_gcontext_t
+overlay_get_font_gc(xcw_state_t* state, xcb_window_t win)
+{
+  xcb_gcontext_t gc = xcb_generate_id(state->xcon);
+  uint32_t mask = XCB_GC_FOREGROUND | XCB_GC_BACKGROUND | XCB_GC_FONT;
+  uint32_t value_list[] = { FG_COLOUR,
+                            argb_premultiply(state->render.overlay_bg),
+                            state->overlay_font };
+  xcb_void_cookie_t cgc =
+    (XCW_REQUEST(xcb_create_gc, state->xcon, gc, win, mask, value_list));
+  xorg_track_request(&(state->requests), cgc, "create_gc");
+  stats_created(RESOURCE_GC);
+  return gc;
+}
+
+/**
+ * Render the current text of an overlay window into its label pixmap, which is
+ * reused if it's already the right size.  ARGB overlays have no label pixmap:
+ * this only places the label, and `overlay_paint` draws it onto the window.
+ *
+ * wsetup: containing the overlay window, which must have text
+ */
+void
+overlay_render_label(xcw_state_t* state, window_setup_t* wsetup)
+{
+  xcb_connection_t* xcon = state->xcon;
+  xcb_window_t win = wsetup->overlay_window;
+  // FreeType text is drawn through XRender, which doesn't need a GC
+  if (wsetup->overlay_font_gc == XCB_NONE && state->glyphs == NULL) {
+    wsetup->overlay_font_gc = overlay_get_font_gc(state, win);
+  }
+
+  int width, height, baseline;
+  label_extents(state, wsetup->overlay_text, &width, &height, &baseline);
+  xcb_rectangle_t* label_rect = &(wsetup->overlay_label_rect);
+  // label-sized overlays are already placed at the anchor
+  anchor_lookup_t* anchor = state->input->label_overlays
+                              ? &(ALL_ANCHORS[0])
+                              : state->input->anchor;
+  // the label pixmap is the size of the previous label
+  int resized = (label_rect->width != width || label_rect->height != height);
+  *label_rect = label_place(anchor, &(wsetup->overlay_rect), width, height);
+
+  if (state->render.overlay_argb) {
+    if (wsetup->overlay_label_picture == XCB_NONE && state->glyphs != NULL) {
+      wsetup->overlay_label_picture = xcb_generate_id(xcon);
+      XCW_REQUEST(
+        xcb_render_create_picture,
+        xcon,
+        wsetup->overlay_label_picture,
+        win,
+        state->render.overlay_format,
+        0,
+        NULL);
+      stats_created(RESOURCE_PICTURE);
+    }
+    return;
+  }
+
+  if (wsetup->overlay_bg_gc == XCB_NONE) {
+    wsetup->overlay_bg_gc = overlay_get_bg_gc(state, win);
+  }
+  if (wsetup->overlay_label_pixmap != XCB_NONE && resized) {
+    XCW_REQUEST(xcb_render_free_picture, xcon, wsetup->overlay_label_picture);
+    stats_freed(RESOURCE_PICTURE);
+    XCW_REQUEST(xcb_free_pixmap, xcon, wsetup->overlay_label_pixmap);
+    stats_freed(RESOURCE_PIXMAP);
+    wsetup->overlay_label_pixmap = XCB_NONE;
+  }
+
+  if (wsetup->overlay_label_pixmap == XCB_NONE) {
+    wsetup->overlay_label_pixmap = xcb_generate_id(xcon);
+    XCW_REQUEST(
+      xcb_create_pixmap,
+      xcon,
+      state->render.screen->root_depth,
+      wsetup->overlay_label_pixmap,
+      win,
+      width,
+      height);
+    stats_created(RESOURCE_PIXMAP);
+
+    uint32_t values[2];
+    values[0] = XCB_RENDER_POLY_MODE_IMPRECISE;
+    values[1] = XCB_RENDER_POLY_EDGE_SMOOTH;
+    wsetup->overlay_label_picture = xcb_generate_id(xcon);
+    XCW_REQUEST(
+      xcb_render_create_picture,
+      xcon,
+      wsetup->overlay_label_picture, // pid
+      wsetup->overlay_label_pixmap,  // drawable
+      state->render.root_format,     // format
+      XCB_RENDER_CP_POLY_MODE | XCB_RENDER_CP_POLY_EDGE,
+      values); // make it smooth
+    stats_created(RESOURCE_PICTURE);
+  }
+
+  xcb_rectangle_t fill = { 0, 0, width, height };
+  XCW_REQUEST(
+    xcb_poly_fill_rectangle,
+    xcon,
+    wsetup->overlay_label_pixmap,
+    wsetup->overlay_bg_gc,
+    1,
+    &fill);
+  if (state->glyphs != NULL) {
+    xorg_draw_text(
+      state, wsetup->overlay_label_picture, 0, baseline, wsetup->overlay_text);
+  } else {
+    XCW_REQUEST(
+      xcb_image_text_8,
+      xcon,
+      min(strlen(wsetup->overlay_text), 255),
+      wsetup->overlay_label_pixmap,
+      wsetup->overlay_font_gc,
+      0,
+      baseline,
+      wsetup->overlay_text);
+  }
+}
+
+/**
+ * Repaint part of an overlay window with its current text.  The server fills
+ * exposed areas with the background colour, so only the label needs copying.
+ * ARGB overlays get the text composited straight onto the window instead,
+ * clipped to the area so that text still on screen isn't blended twice.
+ * `xcb_flush` should be called after calling this function.
+ *
+ * wsetup: containing the overlay window (if there is no overlay window, or it
+ *     has no text yet, this function does nothing)
+ * area: part of the overlay window to repaint
+ */
+void
+overlay_paint(xcw_state_t* state, window_setup_t* wsetup, xcb_rectangle_t* area)
+{
+  if (wsetup->overlay_window == XCB_NONE || wsetup->overlay_text == NULL)
+    return;
+
+  xcb_rectangle_t* label_rect = &(wsetup->overlay_label_rect);
+  xcb_rectangle_t dest;
+  if (!rect_intersect(area, label_rect, &dest))
+    return;
+
+  if (state->render.overlay_argb) {
+    char* text = wsetup->overlay_text;
+    int width, height, baseline;
+    label_extents(state, text, &width, &height, &baseline);
+    if (state->glyphs != NULL) {
+      XCW_REQUEST(
+        xcb_render_set_picture_clip_rectangles,
+        state->xcon,
+        wsetup->overlay_label_picture,
+        0,
+        0,
+        1,
+        &dest);
+      xorg_draw_text(state,
+                     wsetup->overlay_label_picture,
+                     label_rect->x,
+                     label_rect->y + baseline,
+                     text);
+    } else {
+      // core font text draws its own background, so can be drawn again
+      XCW_REQUEST(
+        xcb_image_text_8,
+        state->xcon,
+        min(strlen(text), 255),
+        wsetup->overlay_window,
+        wsetup->overlay_font_gc,
+        label_rect->x,
+        label_rect->y + baseline,
+        text);
+    }
+    return;
+  }
+
+  XCW_REQUEST(
+    xcb_copy_area,
+    state->xcon,
+    wsetup->overlay_label_pixmap,
+    wsetup->overlay_window,
+    wsetup->overlay_bg_gc,
+    dest.x - label_rect->x,
+    dest.y - label_rect->y,
+    dest.x,
+    dest.y,
+    dest.width,
+    dest.height);
+}
+
+/**
+ * Move and resize a label-sized overlay window to fit its current text, placed
+ * at the anchor on the tracked window.  `xcb_flush` should be called after
+ * calling this function.
+ */
+void
+overlay_fit_label(xcw_state_t* state, window_setup_t* wsetup)
+{
+  int width, height, baseline;
+  label_extents(state, wsetup->overlay_text, &width, &height, &baseline);
+  xcb_rectangle_t rect = label_place(state->input->anchor,
+                                     &(wsetup->window_rect),
+                                     width + 2 * LABEL_PADDING,
+                                     height + 2 * LABEL_PADDING);
+  xorg_window_move_resize(state->xcon,
+                          wsetup->overlay_window,
+                          rect.x,
+                          rect.y,
+                          rect.width,
+                          rect.height);
+  xcb_rectangle_t overlay_rect = { 0, 0, rect.width, rect.height };
+  wsetup->overlay_rect = overlay_rect;
+}
+
+/**
+ * Set the text on an overlay window.  `xcb_flush` should be called after
+ * calling this function.  In shared overlay mode, this only lays out the label,
+ * and `shared_overlay_paint` draws it.
+ *
+ * wsetup: containing the overlay window (if it's not a bottom-level structure,
+ *     this function does nothing)
+ * text: text to render (null-terminated, must be at most 255 characters)
+ */
+void
+overlay_set_text(xcw_state_t* state, window_setup_t* wsetup, char* text)
+{
+  if (wsetup->window == XCB_NONE)
+    return;
+  if (wsetup->overlay_text != NULL && strcmp(wsetup->overlay_text, text) == 0)
+    return;
+
+  xcw_free(HEAP_LABELS, wsetup->overlay_text);
+  wsetup->overlay_text = xcw_strdup(HEAP_LABELS, text);
+
+  if (state->input->shared_overlay) {
+    int width, height, baseline;
+    label_extents(state, text, &width, &height, &baseline);
+    wsetup->overlay_label_rect = label_place(
+      state->input->anchor, &(wsetup->overlay_rect), width, height);
+    return;
+  }
+
+  if (state->input->label_overlays)
+    overlay_fit_label(state, wsetup);
+  overlay_render_label(state, wsetup);
+
+  // the previous label may have covered more of the window
+  XCW_REQUEST(
+    xcb_clear_area, state->xcon, 0, wsetup->overlay_window, 0, 0, 0, 0);
+  overlay_paint(state, wsetup, &(wsetup->overlay_rect));
+}
+
+/**
+ * See `overlays_set_text`.  `xcb_flush` should be called after calling * this
+ * function.
+ *
+ * wsetups: array of setup structures containing overlay windows to render text
+ *     on (recursively)
+ * text: prefix to text rendered to every overlay window (null-terminated)
+ */
+void
+_overlays_set_text(
+  xcw_state_t* state,
+  window_setup_t* wsetups,
+  int wsetups_size,
+  char* text)
+{
+  int text_size = strlen(text);
+  // there's no way we're every going to reach 255 characters with the
+  // current setup; this is just in case extra static text gets added
+  if (text_size + 1 > 255) {
+    xcw_warn("refusing to render text longer than 255 characters\n");
+  } else
+    for (int i = 0; i < wsetups_size; i++) {
+      window_setup_t* wsetup = &(wsetups[i]);
+      // next level down is 1 character longer, plus 1 for null
+      char* new_text = xcw_calloc(HEAP_LABELS, text_size + 2, sizeof(char));
+      strcpy(new_text, text);
+      new_text[text_size] = wsetup->character;
+      new_text[text_size + 1] = '\0';
+
+      overlay_set_text(state, wsetup, new_text);
+      if (wsetup->children_size > 0) {
+        _overlays_set_text(
+          state,
+          wsetup_children(state, wsetup),
+          wsetup->children_size,
+          new_text);
+      }
+
+      xcw_free(HEAP_LABELS, new_text);
+    }
+}
+
+// -- shared overlay
+
+/**
+ * See `wsetups_collect_labels`.
+ *
+ * labels_capacity: allocated size of `labels`
+ */
+void
+_wsetups_collect_labels(
+  xcw_state_t* state,
+  window_setup_t* wsetups,
+  int wsetups_size,
+  window_setup_t*** labels,
+  int* labels_size,
+  int* labels_capacity)
+{
+  for (int i = 0; i < wsetups_size; i++) {
+    window_setup_t* wsetup = &(wsetups[i]);
+    if (wsetup->window != XCB_NONE && wsetup->overlay_text != NULL) {
+      if (*labels_size == *labels_capacity) {
+        *labels_capacity = max(*labels_capacity * 2, 16);
+        *labels = xcw_realloc(
+          HEAP_LABELS, *labels, *labels_capacity * sizeof(window_setup_t*));
+      }
+      (*labels)[*labels_size] = wsetup;
+      *labels_size += 1;
+    }
+    _wsetups_collect_labels(
+      state,
+      wsetup_children(state, wsetup),
+      wsetup->children_size,
+      labels,
+      labels_size,
+      labels_capacity);
+  }
+}
+
+/**
+ * Find every bottom-level setup structure below the current level that has a
+ * label.
+ *
+ * labels (output): the structures
+ * labels_size (output): size of `labels`
+ */
+void
+wsetups_collect_labels(
+  xcw_state_t* state,
+  window_setup_t*** labels,
+  int* labels_size)
+{
+  int labels_capacity = 0;
+  *labels = NULL;
+  *labels_size = 0;
+  _wsetups_collect_labels(
+    state,
+    state->wsetups,
+    state->wsetups_size,
+    labels,
+    labels_size,
+    &labels_capacity);
+}
+
+/**
+ * Create an overlay window used in shared overlay mode.  It starts with an
+ * empty shape, so nothing is visible until `shared_overlay_paint`.
+ *
+ * rect: on-screen area to cover
+ */
+void
+shared_overlay_create(
+  xcw_state_t* state,
+  xcb_rectangle_t rect,
+  shared_overlay_t* overlay)
+{
+  xcb_connection_t* xcon = state->xcon;
+  overlay->rect = rect;
+
+  render_context_t* render = &(state->render);
+  overlay->window = xcb_generate_id(xcon);
+  uint32_t mask =
+    (XCB_CW_BACK_PIXEL | XCB_CW_BORDER_PIXEL | XCB_CW_OVERRIDE_REDIRECT |
+     XCB_CW_EVENT_MASK | XCB_CW_COLORMAP);
+  uint32_t values[] = { argb_premultiply(render->overlay_bg),
+                        0,
+                        1,
+                        XCB_EVENT_MASK_EXPOSURE | XCB_EVENT_MASK_KEY_PRESS,
+                        render->overlay_colormap };
+  xcb_void_cookie_t cwc = XCW_REQUEST(
+    xcb_create_window,
+    xcon,
+    render->overlay_depth,
+    overlay->window,
+    state->xroot,
+    rect.x,
+    rect.y,
+    rect.width,
+    rect.height,
+    0,
+    XCB_WINDOW_CLASS_INPUT_OUTPUT,
+    render->overlay_visual,
+    mask,
+    values);
+  xorg_track_request(&(state->requests), cwc, "create_window");
+  stats_created(RESOURCE_WINDOW);
+  XCW_REQUEST(
+    xcb_icccm_set_wm_class,
+    xcon,
+    overlay->window,
+    sizeof(OVERLAY_WINDOW_CLASS),
+    OVERLAY_WINDOW_CLASS);
+  XCW_REQUEST(
+    xcb_shape_rectangles,
+    xcon,
+    XCB_SHAPE_SO_SET,
+    XCB_SHAPE_SK_BOUNDING,
+    XCB_CLIP_ORDERING_UNSORTED,
+    overlay->window,
+    0,
+    0,
+    0,
+    NULL);
+
+  overlay->picture = xcb_generate_id(xcon);
+  XCW_REQUEST(
+    xcb_render_create_picture,
+    xcon,
+    overlay->picture,
+    overlay->window,
+    render->overlay_format,
+    0,
+    NULL);
+  stats_created(RESOURCE_PICTURE);
+  overlay->font_gc = XCB_NONE;
+  if (state->glyphs == NULL)
+    overlay->font_gc = overlay_get_font_gc(state, overlay->window);
+
+  XCW_REQUEST(xcb_map_window, xcon, overlay->window);
+}
+
+/**
+ * Create the overlay windows used in shared overlay mode, one for each monitor,
+ * so that each monitor is painted in its own pass.
+ */
+void
+shared_overlays_initialise(xcw_state_t* state)
+{
+  state->shared_overlays =
+    xcw_calloc(HEAP_LABELS, state->monitors_size, sizeof(shared_overlay_t));
+  state->shared_overlays_size = state->monitors_size;
+  for (int i = 0; i < state->monitors_size; i++)
+    shared_overlay_create(
+      state, state->monitors[i], &(state->shared_overlays[i]));
+}
+
+/**
+ * Destroy the overlay windows used in shared overlay mode.  Requests are only
+ * queued: `xcb_flush` should be called after calling this function.
+ */
+void
+shared_overlays_free(xcw_state_t* state)
+{
+  for (int i = 0; i < state->shared_overlays_size; i++) {
+    shared_overlay_t* overlay = &(state->shared_overlays[i]);
+    XCW_REQUEST(xcb_render_free_picture, state->xcon, overlay->picture);
+    stats_freed(RESOURCE_PICTURE);
+    if (overlay->font_gc != XCB_NONE) {
+      XCW_REQUEST(xcb_free_gc, state->xcon, overlay->font_gc);
+      stats_freed(RESOURCE_GC);
+    }
+    XCW_REQUEST(xcb_destroy_window, state->xcon, overlay->window);
+    stats_freed(RESOURCE_WINDOW);
+  }
+  xcw_free(HEAP_LABELS, state->shared_overlays);
+  state->shared_overlays = NULL;
+  state->shared_overlays_size = 0;
+}
+
+/**
+ * Draw every label on a shared overlay window and shape the window to cover
+ * just those labels.  With FreeType, all labels are drawn in one background
+ * fill and one text composite.  `xcb_flush` should be called after calling
+ * this function.
+ */
+void
+shared_overlay_paint(xcw_state_t* state, shared_overlay_t* overlay)
+{
+  xcb_connection_t* xcon = state->xcon;
+  window_setup_t** all_labels;
+  int all_labels_size;
+  wsetups_collect_labels(state, &all_labels, &all_labels_size);
+
+  // only labels on this overlay, in its coordinates
+  window_setup_t** labels =
+    xcw_calloc(HEAP_LABELS, all_labels_size, sizeof(window_setup_t*));
+  xcb_rectangle_t* rects =
+    xcw_calloc(HEAP_LABELS, all_labels_size, sizeof(xcb_rectangle_t));
+  int size = 0;
+  int glyphs_size = 0;
+  for (int i = 0; i < all_labels_size; i++) {
+    xcb_rectangle_t rect;
+    if (!rect_intersect(
+          &(all_labels[i]->overlay_label_rect), &(overlay->rect), &rect))
+      continue;
+    labels[size] = all_labels[i];
+    rects[size] = all_labels[i]->overlay_label_rect;
+    rects[size].x -= overlay->rect.x;
+    rects[size].y -= overlay->rect.y;
+    glyphs_size += strlen(all_labels[i]->overlay_text);
+    size += 1;
+  }
+
+  XCW_REQUEST(
+    xcb_shape_rectangles,
+    xcon,
+    XCB_SHAPE_SO_SET,
+    XCB_SHAPE_SK_BOUNDING,
+    XCB_CLIP_ORDERING_UNSORTED,
+    overlay->window,
+    0,
+    0,
+    size,
+    rects);
+
+  if (state->glyphs != NULL && state->glyphs->atlas != XCB_NONE && size > 0) {
+    XCW_REQUEST(
+      xcb_render_fill_rectangles,
+      xcon,
+      XCB_RENDER_PICT_OP_SRC,
+      overlay->picture,
+      render_colour(state->render.overlay_bg),
+      size,
+      rects);
+    for (int i = 0; i < size; i++) {
+      struct utf_holder holder = char_to_uint32(labels[i]->overlay_text);
+      glyph_atlas_draw(state,
+                       overlay->picture,
+                       rects[i].x,
+                       rects[i].y + state->glyphs->ascent,
+                       holder);
+      utf_holder_destroy(holder);
+    }
+  } else if (state->glyphs != NULL && size > 0) {
+    XCW_REQUEST(
+      xcb_render_fill_rectangles,
+      xcon,
+      XCB_RENDER_PICT_OP_SRC,
+      overlay->picture,
+      render_colour(state->render.overlay_bg),
+      size,
+      rects);
+
+    // glyph positions are relative to where the previous glyph left the pen
+    xcb_render_util_composite_text_stream_t* ts =
+      xcb_render_util_composite_text_stream(
+        state->glyphs->glyphset, glyphs_size, 0);
+    int pen_x = 0;
+    int pen_y = 0;
+    for (int i = 0; i < size; i++) {
+      struct utf_holder holder = char_to_uint32(labels[i]->overlay_text);
+      int x = rects[i].x;
+      int y = rects[i].y + state->glyphs->ascent;
+      xcb_render_util_glyphs_32(
+        ts, x - pen_x, y - pen_y, holder.length, holder.str);
+
+      pen_x = x;
+      pen_y = y;
+      for (int j = 0; j < holder.length; j++) {
+        glyph_metrics_t* metrics =
+          glyph_cache_metrics(state->glyphs, holder.str[j]);
+        if (metrics != NULL)
+          pen_x += metrics->advance;
+      }
+      utf_holder_destroy(holder);
+    }
+    XCW_REQUEST(
+      xcb_render_util_composite_text,
+      xcon,
+      XCB_RENDER_PICT_OP_OVER,
+      state->fg_pen,
+      overlay->picture,
+      0,
+      0,
+      0,
+      ts);
+    xcb_render_util_composite_text_free(ts);
+  } else {
+    // core font text draws its own background
+    for (int i = 0; i < size; i++) {
+      char* text = labels[i]->overlay_text;
+      XCW_REQUEST(
+        xcb_image_text_8,
+        xcon,
+        min(strlen(text), 255),
+        overlay->window,
+        overlay->font_gc,
+        rects[i].x,
+        rects[i].y + state->overlay_font_info->font_ascent,
+        text);
+    }
+  }
+
+  xcw_free(HEAP_LABELS, rects);
+  xcw_free(HEAP_LABELS, labels);
+  xcw_free(HEAP_LABELS, all_labels);
+}
+
+// -- all overlays
+
+/**
+ * Update text on all overlay windows.
+ */
+void
+overlays_set_text(xcw_state_t* state)
+{
+  char* text = "";
+  _overlays_set_text(state, state->wsetups, state->wsetups_size, text);
+  for (int i = 0; i < state->shared_overlays_size; i++)
+    shared_overlay_paint(state, &(state->shared_overlays[i]));
+  xcb_flush(state->xcon);
+}
+
+// -- wsetup utilities
+
+/**
+ * Create a bottom-level `wsetup_t`.
+ *
+ * twindow: the window to track
+ * character: bottom-level character in the window label
+ */
+window_setup_t
+initialise_window_setup(
+  xcw_state_t* state,
+  tracked_window_t* twindow,
+  char character)
+{
+  xcb_rectangle_t rect = { 0, 0, twindow->rect.width, twindow->rect.height };
+  xcb_window_t overlay_window = XCB_NONE;
+  if (state->input->shared_overlay) {
+    rect = twindow->rect;
+  } else if (state->input->label_overlays) {
+    // sized to fit the label by `overlay_fit_label`
+    rect.width = 1;
+    rect.height = 1;
+    overlay_window =
+      overlay_create(state, twindow->rect.x, twindow->rect.y, 1, 1);
+  } else {
+    overlay_window = overlay_create(
+      state, twindow->rect.x, twindow->rect.y, rect.width, rect.height);
+  }
+
+  window_setup_t wsetup = { overlay_window,
+                            XCB_NONE,
+                            XCB_NONE,
+                            rect,
+                            twindow->window,
+                            character,
+                            -1,
+                            0 };
+  if (twindow->window_class != NULL)
+    wsetup.window_class = xcw_strdup(HEAP_LABELS, twindow->window_class);
+  wsetup.window_rect = twindow->rect;
+  return wsetup;
+}
+
+/**
+ * Make the overlay window of a bottom-level `wsetup_t` findable through
+ * `state->overlays`.
+ */
+void
+wsetup_track_overlay(xcw_state_t* state, window_setup_t* wsetup)
+{
+  if (wsetup->overlay_window != XCB_NONE)
+    xid_table_set(state->overlays, wsetup->overlay_window, wsetup);
+}
+
+/**
+ * Order label tree leaves by increasing weight.  Among equal weights, later
+ * windows come first, so that they're merged first and earlier windows get
+ * the shorter labels.
+ */
+int
+label_node_compare(const void* a, const void* b)
+{
+  label_node_t* na = (label_node_t*)a;
+  label_node_t* nb = (label_node_t*)b;
+  if (na->weight != nb->weight)
+    return na->weight < nb->weight ? -1 : 1;
+  return nb->window - na->window;
+}
+
+/**
+ * Build an optimal prefix-free code over the `ksl` alphabet for the tracked
+ * windows, so that the expected number of keys typed, weighted by the selection
+ * history, is minimal.
+ *
+ * This is Huffman's algorithm with `ksl_size` children per node.  Leaves are
+ * sorted once; after that, the internal nodes are built in order of increasing
+ * weight, so the smallest remaining nodes are always at the front of either
+ * the leaves or the internal nodes, and building takes linear time.  Padding
+ * leaves of weight 0 make every internal node full.
+ *
+ * tree (output): the code, to be freed with `label_tree_free`
+ */
+void
+label_tree_build(
+  xcw_state_t* state,
+  tracked_window_t* windows,
+  int windows_size,
+  label_tree_t* tree)
+{
+  int k = state->input->ksl_size;
+  tree->root = -1;
+  tree->nodes = NULL;
+  tree->children = NULL;
+  tree->size = 0;
+  if (windows_size == 0)
+    return;
+
+  int padding = (k - 1 - (windows_size - 1) % (k - 1)) % (k - 1);
+  int leaves_size = windows_size + padding;
+  int capacity = leaves_size + (leaves_size - 1) / (k - 1);
+  tree->nodes = xcw_calloc(HEAP_LABELS, capacity, sizeof(label_node_t));
+  tree->children = xcw_calloc(HEAP_LABELS, max(capacity - 1, 1), sizeof(int));
+
+  for (int i = 0; i < padding; i++) {
+    label_node_t node = { 0, -1, 0, 0 };
+    tree->nodes[i] = node;
+  }
+  for (int i = 0; i < windows_size; i++) {
+    label_node_t node = {
+      history_weight(&(state->history), windows[i].window_class), i, 0, 0
+    };
+    tree->nodes[padding + i] = node;
+  }
+  // padding has the lowest weight, so it's already in place
+  qsort(&(tree->nodes[padding]),
+        windows_size,
+        sizeof(label_node_t),
+        label_node_compare);
+
+  int next_leaf = 0;
+  int next_internal = leaves_size;
+  tree->size = leaves_size;
+  int children_size = 0;
+  while ((leaves_size - next_leaf) + (tree->size - next_internal) > 1) {
+    label_node_t parent = { 0, -1, children_size, k };
+    for (int i = 0; i < k; i++) {
+      int child;
+      if (
+        next_leaf < leaves_size &&
+        (next_internal == tree->size ||
+         tree->nodes[next_leaf].weight <= tree->nodes[next_internal].weight))
+        child = next_leaf++;
+      else
+        child = next_internal++;
+      tree->children[children_size] = child;
+      children_size += 1;
+      parent.weight += tree->nodes[child].weight;
+    }
+    tree->nodes[tree->size] = parent;
+    tree->size += 1;
+  }
+  tree->root = tree->size - 1;
+}
+
+/**
+ * Free the memory used by a tree built by `label_tree_build`.
+ */
+void
+label_tree_free(label_tree_t* tree)
+{
+  xcw_free(HEAP_LABELS, tree->nodes);
+  xcw_free(HEAP_LABELS, tree->children);
+}
+
+/**
+ * See `initialise_window_tracking`.
+ *
+ * node: index in `tree` of the node whose children are created
+ * wsetups (output): index in the arena of the first created structure
+ */
+void
+_initialise_window_tracking(
+  xcw_state_t* state,
+  label_tree_t* tree,
+  int node,
+  tracked_window_t* windows,
+  int* wsetups,
+  int* wsetups_size)
+{
+  wsetup_arena_t* arena = &(state->wsetup_arena);
+  label_node_t* parent = &(tree->nodes[node]);
+  int* children = &(tree->children[parent->children]);
+  int n = 0;
+  for (int i = 0; i < parent->children_size; i++) {
+    label_node_t* child = &(tree->nodes[children[i]]);
+    if (child->window >= 0 || child->children_size > 0)
+      n += 1;
+  }
+  // siblings must be contiguous, so take them before any children
+  *wsetups = wsetup_arena_take(arena, n);
+  *wsetups_size = n;
+
+  // children were merged lightest first, so give the first characters to the
+  // heaviest; child `c` types `ksl[c]`, which `handle_keypress` relies on
+  int c = 0;
+  for (int i = parent->children_size - 1; i >= 0; i--) {
+    label_node_t* child = &(tree->nodes[children[i]]);
+    if (child->window < 0 && child->children_size == 0)
+      continue;
+    window_setup_t* wsetup = &(arena->nodes[*wsetups + c]);
+    char character = state->input->ksl[c].character;
+    c += 1;
+
+    if (child->window >= 0) {
+      *wsetup =
+        initialise_window_setup(state, &(windows[child->window]), character);
+      wsetup_track_overlay(state, wsetup);
+    } else {
+      int grandchildren;
+      int grandchildren_size;
+      _initialise_window_tracking(
+        state,
+        tree,
+        children[i],
+        windows,
+        &grandchildren,
+        &grandchildren_size);
+      window_setup_t internal = { XCB_NONE,
+                                  XCB_NONE,
+                                  XCB_NONE,
+                                  { 0, 0, 0, 0 },
+                                  XCB_NONE,
+                                  character,
+                                  grandchildren,
+                                  grandchildren_size };
+      *wsetup = internal;
+    }
+  }
+}
+
+/**
+ * Construct data for tracked windows in a nested structure matching the
+ * characters that need to be typed to choose them.
+ *
+ * state: the result is stored in here
+ * windows: tracked windows
+ */
+void
+initialise_window_tracking(
+  xcw_state_t* state,
+  tracked_window_t* windows,
+  int windows_size)
+{
+  if (state->input->shared_overlay) {
+    const xcb_query_extension_reply_t* shape =
+      xcb_get_extension_data(state->xcon, &xcb_shape_id);
+    if (shape == NULL || !shape->present) {
+      xcw_warn("no SHAPE extension, using one overlay window per window\n");
+      state->input->shared_overlay = 0;
+    }
+  }
+
+  wsetup_arena_initialise(&(state->wsetup_arena), windows_size);
+  label_tree_t tree;
+  label_tree_build(state, windows, windows_size, &tree);
+  int wsetups = 0;
+  state->wsetups_size = 0;
+  if (windows_size == 1) {
+    // the root is the only window
+    wsetups = wsetup_arena_take(&(state->wsetup_arena), 1);
+    state->wsetup_arena.nodes[wsetups] = initialise_window_setup(
+      state, &(windows[0]), state->input->ksl[0].character);
+    wsetup_track_overlay(state, &(state->wsetup_arena.nodes[wsetups]));
+    state->wsetups_size = 1;
+  } else if (windows_size > 1) {
+    _initialise_window_tracking(
+      state, &tree, tree.root, windows, &wsetups, &(state->wsetups_size));
+  }
+  state->wsetups = &(state->wsetup_arena.nodes[wsetups]);
+  state->root_wsetups = state->wsetups;
+  state->root_wsetups_size = state->wsetups_size;
+  label_tree_free(&tree);
+
+  if (state->input->shared_overlay)
+    shared_overlays_initialise(state);
+}
+
+/**
+ * See `wsetup_debug_print`.
+ *
+ * depth: current depth in the structure, starting at 0, used for indentation
+ */
+void
+_wsetup_debug_print(xcw_state_t* state, window_setup_t* wsetup, int depth)
+{
+  printf("[wsetup] ");
+  for (int i = 0; i < depth; i++)
+    printf("  ");
+  printf("%c", wsetup->character);
+  if (wsetup->window == XCB_NONE)
+    printf("\n");
+  else
+    printf(" %x\n", wsetup->window);
+
+  window_setup_t* children = wsetup_children(state, wsetup);
+  for (int i = 0; i < wsetup->children_size; i++) {
+    _wsetup_debug_print(state, &(children[i]), depth + 1);
+  }
+}
+
+/**
+ * Print a setup structure to stdout.
+ */
+void
+wsetup_debug_print(xcw_state_t* state, window_setup_t* wsetup)
+{
+  _wsetup_debug_print(state, wsetup, 0);
+}
+
+/**
+ * Destroy all overlay windows in a setup structure and free the memory it uses
+ * outside the arena.  Requests are only queued: `xcb_flush` should be called
+ * after calling this function.
+ */
+void
+wsetup_free(xcw_state_t* state, window_setup_t* wsetup)
+{
+  xcb_connection_t* xcon = state->xcon;
+  // with ARGB overlays, the picture is for the window
+  if (wsetup->overlay_label_picture != XCB_NONE) {
+    XCW_REQUEST(xcb_render_free_picture, xcon, wsetup->overlay_label_picture);
+    stats_freed(RESOURCE_PICTURE);
+    wsetup->overlay_label_picture = XCB_NONE;
+  }
+  if (wsetup->overlay_window != XCB_NONE) {
+    xid_table_remove(state->overlays, wsetup->overlay_window);
+    XCW_REQUEST(xcb_destroy_window, xcon, wsetup->overlay_window);
+    stats_freed(RESOURCE_WINDOW);
+    wsetup->overlay_window = XCB_NONE;
+  }
+  xcw_free(HEAP_LABELS, wsetup->overlay_text);
+  wsetup->overlay_text = NULL;
+  xcw_free(HEAP_LABELS, wsetup->window_class);
+  wsetup->window_class = NULL;
+  if (wsetup->overlay_label_pixmap != XCB_NONE) {
+    XCW_REQUEST(xcb_free_pixmap, xcon, wsetup->overlay_label_pixmap);
+    stats_freed(RESOURCE_PIXMAP);
+    wsetup->overlay_label_pixmap = XCB_NONE;
+  }
+  if (wsetup->overlay_bg_gc != XCB_NONE) {
+    XCW_REQUEST(xcb_free_gc, xcon, wsetup->overlay_bg_gc);
+    stats_freed(RESOURCE_GC);
+    wsetup->overlay_bg_gc = XCB_NONE;
+  }
+  if (wsetup->overlay_font_gc != XCB_NONE) {
+    XCW_REQUEST(xcb_free_gc, xcon, wsetup->overlay_font_gc);
+    stats_freed(RESOURCE_GC);
+    wsetup->overlay_font_gc = XCB_NONE;
+  }
+
+  window_setup_t* children = wsetup_children(state, wsetup);
+  for (int i = 0; i < wsetup->children_size; i++) {
+    wsetup_free(state, &(children[i]));
+  }
+}
+
+/**
+ * Map or unmap every overlay window in a setup structure.  Requests are only
+ * queued: `xcb_flush` should be called after calling this function.
+ */
+void
+wsetup_set_mapped(xcw_state_t* state, window_setup_t* wsetup, int mapped)
+{
+  if (wsetup->overlay_window != XCB_NONE) {
+    if (mapped)
+      XCW_REQUEST(xcb_map_window, state->xcon, wsetup->overlay_window);
+    else
+      XCW_REQUEST(xcb_unmap_window, state->xcon, wsetup->overlay_window);
+  }
+
+  window_setup_t* children = wsetup_children(state, wsetup);
+  for (int i = 0; i < wsetup->children_size; i++) {
+    wsetup_set_mapped(state, &(children[i]), mapped);
+  }
+}
+
+/**
+ * Go back to the top level of the setup structures, showing every label again.
+ * The labels are rebuilt from the existing structures, so no windows are looked
+ * up and overlay text is only re-rendered where it changes.  Flushes.
+ */
+void
+wsetups_reset(xcw_state_t* state)
+{
+  if (state->wsetups != state->root_wsetups) {
+    for (int i = 0; i < state->root_wsetups_size; i++)
+      wsetup_set_mapped(state, &(state->root_wsetups[i]), 1);
+    state->wsetups = state->root_wsetups;
+    state->wsetups_size = state->root_wsetups_size;
+  }
+  overlays_set_text(state);
+}
+
+/**
+ * Choose the window in a setup structure or replace the current array of setup
+ * structures with its children.  Updates text rendered on overlay windows.
+ * Ends the session if a window is chosen, except in `--multi` mode, where the
+ * window is printed and every label is shown again.
+ */
+void
+wsetup_choose(xcw_state_t* state, window_setup_t* wsetup)
+{
+  if (wsetup->window != XCB_NONE && wsetup->children_size == 0) {
+    history_record(&(state->history), wsetup->window_class);
+    if (state->input->multi) {
+      session_output(state, wsetup->window);
+      wsetups_reset(state);
+    } else {
+      session_end(state, wsetup->window);
+    }
+  } else {
+    state->wsetups = wsetup_children(state, wsetup);
+    state->wsetups_size = wsetup->children_size;
+    overlays_set_text(state);
+  }
+}
+
+/**
+ * Reduce a setup structure by choosing an item.  Frees removed parts of the
+ * structure, or in `--multi` mode, hides them until `wsetups_reset`.
+ *
+ * All removed overlays are destroyed in one batch of requests, sent in the
+ * same flush as the redraw of the remaining labels, so the display updates in
+ * a single step.
+ *
+ * index: array index in `wsetups` to choose
+ */
+void
+wsetups_descend_by_index(xcw_state_t* state, int index)
+{
+  for (int i = 0; i < state->wsetups_size; i++) {
+    if (i == index)
+      continue;
+    if (state->input->multi)
+      wsetup_set_mapped(state, &(state->wsetups[i]), 0);
+    else
+      wsetup_free(state, &(state->wsetups[i]));
+  }
+  // flushes
+  wsetup_choose(state, &(state->wsetups[index]));
+}
+
+// -- program
+
+/**
+ * Determine whether a window passes the filters that don't need any
+ * information from the X server.
+ *
+ * managed_windows: windows managed by the window manager, or NULL if it
+ *     doesn't define them
+ */
+int
+window_candidate(
+  xcw_state_t* state,
+  xcb_window_t window,
+  xid_table_t* managed_windows)
+{
+  return (
+    // ignore if not managed by the window manager
+    (managed_windows == NULL || xid_table_contains(managed_windows, window)) &&
+
+    // only include if whitelisted
+    (state->input->whitelist_size == 0 ||
+     xid_table_contains(state->input->whitelist_set, window)) &&
+
+    // ignore if blacklisted
+    !xid_table_contains(state->input->blacklist_set, window));
+}
+
+/**
+ * Find which of some windows should be tracked, and where they are.  Every
+ * request needed is sent before any reply is waited on, so this costs a single
+ * round trip however many windows there are.
+ *
+ * Positions are found with `translate_coordinates`, so they're right even for
+ * windows that aren't children of the root window, as with reparenting window
+ * managers.
+ *
+ * candidates: windows to classify
+ * windows (output): tracked windows, in the order of `candidates`
+ * windows_size (output): size of `windows`
+ */
+void
+classify_windows(
+  xcw_state_t* state,
+  xcb_window_t* candidates,
+  int candidates_size,
+  tracked_window_t** windows,
+  int* windows_size)
+{
+  window_query_t* wqs =
+    xcw_calloc(HEAP_WINDOWS, candidates_size, sizeof(window_query_t));
+  xcb_get_geometry_cookie_t* ggcs = xcw_calloc(
+    HEAP_WINDOWS, candidates_size, sizeof(xcb_get_geometry_cookie_t));
+  xcb_translate_coordinates_cookie_t* tccs = xcw_calloc(
+    HEAP_WINDOWS, candidates_size, sizeof(xcb_translate_coordinates_cookie_t));
+  xcb_get_property_cookie_t* gccs = xcw_calloc(
+    HEAP_WINDOWS, candidates_size, sizeof(xcb_get_property_cookie_t));
+  xcb_get_property_cookie_t cdc = current_desktop_request(state);
+  for (int i = 0; i < candidates_size; i++) {
+    wqs[i] = window_query(state, candidates[i]);
+    // an xcb_window_t is an xcb_drawable_t
+    ggcs[i] = XCW_REQUEST(xcb_get_geometry, state->xcon, candidates[i]);
+    // the origin of the window's contents, inside its border
+    tccs[i] =
+      XCW_REQUEST(
+        xcb_translate_coordinates,
+        state->xcon,
+        candidates[i],
+        state->xroot,
+        0,
+        0);
+    gccs[i] = XCW_REQUEST(xcb_icccm_get_wm_class, state->xcon, candidates[i]);
+  }
+  xcb_flush(state->xcon);
+
+  current_desktop_reply(state, cdc);
+  *windows =
+    xcw_calloc(HEAP_WINDOWS, candidates_size, sizeof(tracked_window_t));
+  int size = 0;
+  for (int i = 0; i < candidates_size; i++) {
+    // replies are NULL if the window was destroyed since we listed it
+    window_info_t info = window_query_reply(state, &(wqs[i]));
+    xcb_get_geometry_reply_t* ggr =
+      XCW_REPLY(xcb_get_geometry_reply, state->xcon, ggcs[i], NULL);
+    xcb_translate_coordinates_reply_t* tcr =
+      XCW_REPLY(xcb_translate_coordinates_reply, state->xcon, tccs[i], NULL);
+    char* window_class = icccm_window_class(state, gccs[i]);
+
+    if (ggr != NULL && tcr != NULL && window_info_normal(state, &info)) {
+      tracked_window_t twindow = {
+        candidates[i],
+        { tcr->dst_x, tcr->dst_y, ggr->width, ggr->height },
+        window_class
+      };
+      (*windows)[size] = twindow;
+      size += 1;
+    } else {
+      xcw_free(HEAP_WINDOWS, window_class);
+    }
+
+    free(ggr);
+    free(tcr);
+  }
+  *windows =
+    xcw_realloc(HEAP_WINDOWS, *windows, size * sizeof(tracked_window_t));
+  *windows_size = size;
+
+  xcw_free(HEAP_WINDOWS, wqs);
+  xcw_free(HEAP_WINDOWS, ggcs);
+  xcw_free(HEAP_WINDOWS, tccs);
+  xcw_free(HEAP_WINDOWS, gccs);
+}
+
+/**
+ * Get the windows to track.
+ *
+ * If the window manager lists the windows it manages, those are the
+ * candidates, since with a reparenting window manager they aren't children of
+ * the root window.  Otherwise every child of the root window is a candidate.
+ *
+ * windows (output): tracked windows
+ * windows_size (output): size of `windows`
+ */
+void
+initialise_tracked_windows(
+  xcw_state_t* state,
+  tracked_window_t** windows,
+  int* windows_size)
+{
+  int managed_windows_defined;
+  xcb_window_t* all_windows;
+  int all_windows_size;
+  xorg_get_managed_windows(
+    state, &managed_windows_defined, &all_windows, &all_windows_size);
+  if (!managed_windows_defined)
+    xorg_get_windows(state, &all_windows, &all_windows_size);
+
+  int candidates_size = 0;
+  for (int i = 0; i < all_windows_size; i++) {
+    if (window_candidate(state, all_windows[i], NULL)) {
+      all_windows[candidates_size] = all_windows[i];
+      candidates_size += 1;
     }
   }
-  return NULL;
+
+  classify_windows(state, all_windows, candidates_size, windows, windows_size);
+  xcw_free(HEAP_WINDOWS, all_windows);
 }
 
 /**
- * Acquire a Xorg keyboard grab on the root window.
+ * Keep only the tracked windows that are visible on a monitor, and reduce each
+ * to its visible part on the monitor showing most of it, so labels are centred
+ * where they can be seen.
  */
 void
-initialise_input(xcw_state_t* state)
+tracked_windows_clip(
+  xcw_state_t* state,
+  tracked_window_t* windows,
+  int* windows_size)
 {
-  // wait a little for other programs to release the keyboard
-  // since this program is likely to be launched from a hotkey daemon
-  struct timespec ts = { 0, 1000000 }; // 1ms
-  int status;
-  for (int s = 0; s < 1000; s++) { // up to 1s total
-    xcb_grab_keyboard_cookie_t gkc = xcb_grab_keyboard(
-      state->xcon,
-      0,
-      state->xroot,
-      XCB_CURRENT_TIME,
-      XCB_GRAB_MODE_ASYNC,
-      XCB_GRAB_MODE_ASYNC);
-    xcb_grab_keyboard_reply_t* gkr;
-
-    if ((gkr = xcb_grab_keyboard_reply(state->xcon, gkc, NULL))) {
-      status = gkr->status;
-      free(gkr);
-      if (status == XCB_GRAB_STATUS_ALREADY_GRABBED) {
-        nanosleep(&ts, NULL);
-        continue;
-      } else if (status == XCB_GRAB_STATUS_SUCCESS) {
-        break;
-      } else {
-        xcw_die("grab_keyboard: %d\n", status);
-      }
+  int size = 0;
+  for (int i = 0; i < *windows_size; i++) {
+    if (monitors_clip(state, &(windows[i].rect))) {
+      windows[size] = windows[i];
+      size += 1;
     } else {
-      xcw_die("grab_keyboard\n");
+      xcw_free(HEAP_WINDOWS, windows[i].window_class);
     }
   }
+  *windows_size = size;
+}
 
-  if (status == XCB_GRAB_STATUS_ALREADY_GRABBED) {
-    xcw_die("grab_keyboard: already grabbed\n");
+/**
+ * Free tracked windows returned by `initialise_tracked_windows`.
+ */
+void
+tracked_windows_free(tracked_window_t* windows, int windows_size)
+{
+  for (int i = 0; i < windows_size; i++)
+    xcw_free(HEAP_WINDOWS, windows[i].window_class);
+  xcw_free(HEAP_WINDOWS, windows);
+}
+
+// -- live windows
+
+/**
+ * Find the entry for a window in the live window table.
+ *
+ * returns: the entry, or NULL if it isn't there
+ */
+live_window_t*
+live_windows_find(live_windows_t* live, xcb_window_t window)
+{
+  return xid_table_get(live->index, window);
+}
+
+/**
+ * Insert an entry into the stacking order of the live window table.
+ *
+ * below: the entry is placed directly above this one, or at the bottom if NULL
+ */
+void
+live_windows_link(
+  live_windows_t* live,
+  live_window_t* lwindow,
+  live_window_t* below)
+{
+  lwindow->below = below;
+  lwindow->above = below == NULL ? live->bottom : below->above;
+  if (lwindow->below != NULL)
+    lwindow->below->above = lwindow;
+  else
+    live->bottom = lwindow;
+  if (lwindow->above != NULL)
+    lwindow->above->below = lwindow;
+  else
+    live->top = lwindow;
+}
+
+/**
+ * Take an entry out of the stacking order of the live window table, without
+ * freeing it.
+ */
+void
+live_windows_unlink(live_windows_t* live, live_window_t* lwindow)
+{
+  if (lwindow->below != NULL)
+    lwindow->below->above = lwindow->above;
+  else
+    live->bottom = lwindow->above;
+  if (lwindow->above != NULL)
+    lwindow->above->below = lwindow->below;
+  else
+    live->top = lwindow->below;
+  lwindow->below = NULL;
+  lwindow->above = NULL;
+}
+
+/**
+ * Create an entry for the live window table, to be read from the X server by
+ * the next `live_windows_refresh`, and make it findable.
+ */
+live_window_t*
+live_windows_create(live_windows_t* live, xcb_window_t window)
+{
+  live_window_t* lwindow = xcw_malloc(HEAP_WINDOWS, sizeof(live_window_t));
+  live_window_t initial = { window,       { 0, 0, 0, 0 },
+                            0,            0,
+                            0,            0,
+                            ALL_DESKTOPS, NULL,
+                            1,            NULL,
+                            NULL,         0,
+                            XCB_NONE,     XCB_NONE,
+                            { 0, 0 },     XCB_NONE };
+  *lwindow = initial;
+  xid_table_set(live->index, window, lwindow);
+  live->stale = 1;
+  return lwindow;
+}
+
+/**
+ * Add a top-level window to the top of the live window table.
+ */
+void
+live_windows_add(live_windows_t* live, xcb_window_t window)
+{
+  if (live_windows_find(live, window) != NULL)
+    return;
+  live_window_t* lwindow = live_windows_create(live, window);
+  live_windows_link(live, lwindow, live->top);
+  live->size += 1;
+}
+
+/**
+ * Add a managed window inside a frame to the live window table.  Its events
+ * are selected when it's read, by `live_windows_refresh`.
+ */
+void
+live_windows_add_framed(live_windows_t* live, xcb_window_t window)
+{
+  if (live_windows_find(live, window) != NULL)
+    return;
+  live_window_t* lwindow = live_windows_create(live, window);
+  lwindow->in_frame = 1;
+}
+
+/**
+ * Mark an entry in the live window table as out of date.
+ */
+void
+live_window_dirty(live_windows_t* live, live_window_t* lwindow)
+{
+  lwindow->dirty = 1;
+  live->stale = 1;
+}
+
+/**
+ * Remove a window from the live window table, if it's there.
+ */
+void
+live_windows_remove(live_windows_t* live, xcb_window_t window)
+{
+  live_window_t* lwindow = live_windows_find(live, window);
+  if (lwindow == NULL)
+    return;
+  if (lwindow->in_frame) {
+    live_window_t* frame = live_windows_find(live, lwindow->frame);
+    if (frame != NULL && frame->framed == window)
+      frame->framed = XCB_NONE;
+  } else {
+    live_window_t* framed = live_windows_find(live, lwindow->framed);
+    if (framed != NULL && framed->frame == window) {
+      framed->frame = XCB_NONE;
+      live_window_dirty(live, framed);
+    }
+    live_windows_unlink(live, lwindow);
+    live->size -= 1;
   }
+  xid_table_remove(live->index, window);
+  xcw_free(HEAP_WINDOWS, lwindow->window_class);
+  xcw_free(HEAP_WINDOWS, lwindow);
 }
 
-// -- overlay windows
+/**
+ * Move the managed window inside a frame along with it, after the frame's
+ * `rect` has changed.
+ */
+void
+live_window_frame_moved(live_windows_t* live, live_window_t* frame)
+{
+  if (frame->framed == XCB_NONE)
+    return;
+  live_window_t* lwindow = live_windows_find(live, frame->framed);
+  if (lwindow == NULL || lwindow->frame != frame->window)
+    return;
+  lwindow->rect.x = frame->rect.x + lwindow->offset.x;
+  lwindow->rect.y = frame->rect.y + lwindow->offset.y;
+}
 
 /**
- * Create an overlay window.
+ * Link a managed window inside a frame with the frame, so that it follows the
+ * frame's ConfigureNotify events.  Does nothing if the frame isn't in the
+ * table.
  *
- * x, y: absolute screen location
- * w, h: window size
+ * frame: the top-level window containing `lwindow`
  */
-xcb_window_t*
-overlay_create(xcw_state_t* state, int x, int y, int w, int h)
+void
+live_window_set_frame(
+  live_windows_t* live,
+  live_window_t* lwindow,
+  xcb_window_t frame)
 {
-  xcb_window_t* win = malloc(sizeof(xcb_window_t));
-  *win = xcb_generate_id(state->xcon);
-  uint32_t mask =
-    (XCB_CW_BACK_PIXEL | XCB_CW_OVERRIDE_REDIRECT | XCB_CW_SAVE_UNDER |
-     XCB_CW_EVENT_MASK);
-  uint32_t values[] = {
-    BG_COLOUR, 1, 1, XCB_EVENT_MASK_EXPOSURE | XCB_EVENT_MASK_KEY_PRESS
-  };
-  xcb_void_cookie_t cwc = xcb_create_window_checked(
+  live_window_t* lframe = live_windows_find(live, frame);
+  if (lframe == NULL || lframe->in_frame)
+    return;
+  lwindow->frame = frame;
+  lwindow->offset.x = lwindow->rect.x - lframe->rect.x;
+  lwindow->offset.y = lwindow->rect.y - lframe->rect.y;
+  lframe->framed = lwindow->window;
+}
+
+/**
+ * Update a managed window inside a frame from a ConfigureNotify event on it.
+ * Positions in real events are relative to the window's parent, and in
+ * synthetic ones, which window managers send when they move a frame, relative
+ * to the root window.
+ */
+void
+live_window_configure(
+  live_windows_t* live,
+  live_window_t* lwindow,
+  xcb_configure_notify_event_t* cn)
+{
+  lwindow->rect.width = cn->width;
+  lwindow->rect.height = cn->height;
+  live_window_t* frame = live_windows_find(live, lwindow->frame);
+  if (cn->response_type & 0x80) {
+    lwindow->rect.x = cn->border_width + cn->x;
+    lwindow->rect.y = cn->border_width + cn->y;
+    if (frame != NULL)
+      live_window_set_frame(live, lwindow, frame->window);
+  } else if (frame != NULL && lwindow->parent == frame->window) {
+    lwindow->offset.x = cn->border_width + cn->x;
+    lwindow->offset.y = cn->border_width + cn->y;
+    live_window_frame_moved(live, frame);
+  } else {
+    // nested in the frame, so the position needs reading again
+    live_window_dirty(live, lwindow);
+  }
+}
+
+/**
+ * Move a window in the stacking order of the live window table.
+ *
+ * sibling: the window is placed directly above this one, or at the bottom if
+ *     `XCB_NONE`
+ */
+void
+live_windows_restack(
+  live_windows_t* live,
+  xcb_window_t window,
+  xcb_window_t sibling)
+{
+  live_window_t* lwindow = live_windows_find(live, window);
+  if (lwindow == NULL || lwindow->in_frame || sibling == window)
+    return;
+  // unknown siblings put the window at the bottom, which the next
+  // ConfigureNotify corrects
+  live_window_t* below =
+    sibling == XCB_NONE ? NULL : live_windows_find(live, sibling);
+  if (below != NULL && below->in_frame)
+    below = NULL;
+  live_windows_unlink(live, lwindow);
+  live_windows_link(live, lwindow, below);
+}
+
+/**
+ * Determine whether a window was created by this program, so that overlay
+ * windows can be left out of the live window table.
+ */
+int
+live_windows_own(xcw_state_t* state, xcb_window_t window)
+{
+  const xcb_setup_t* setup = xcb_get_setup(state->xcon);
+  return ((window & ~setup->resource_id_mask) == setup->resource_id_base);
+}
+
+/**
+ * Read the windows managed by the window manager, and keep an entry in the
+ * live window table for each one that's inside a frame.  Costs a round trip.
+ */
+void
+live_windows_refresh_managed(xcw_state_t* state)
+{
+  live_windows_t* live = state->live;
+  xcb_window_t* old_list = live->managed_list;
+  int old_list_size = live->managed_list_size;
+  if (live->managed != NULL)
+    xid_table_free(live->managed);
+  live->managed = NULL;
+  live->managed_list = NULL;
+  live->managed_list_size = 0;
+  int managed_windows_defined;
+  xorg_get_managed_windows(state,
+                           &managed_windows_defined,
+                           &(live->managed_list),
+                           &(live->managed_list_size));
+  if (managed_windows_defined)
+    live->managed =
+      xid_table_from_windows(live->managed_list, live->managed_list_size);
+  live->managed_dirty = 0;
+
+  // managed windows that are top-level windows are already in the table
+  for (int i = 0; i < live->managed_list_size; i++)
+    live_windows_add_framed(live, live->managed_list[i]);
+  for (int i = 0; i < old_list_size; i++) {
+    live_window_t* lwindow = live_windows_find(live, old_list[i]);
+    int managed =
+      (live->managed != NULL && xid_table_contains(live->managed, old_list[i]));
+    if (lwindow != NULL && lwindow->in_frame && !managed)
+      live_windows_remove(live, old_list[i]);
+  }
+  xcw_free(HEAP_WINDOWS, old_list);
+}
+
+/**
+ * Find the frame of each managed window inside a frame: the top-level window
+ * containing it.  Window managers may nest a window more than one level deep,
+ * so this walks up the tree, with a round trip per level.
+ *
+ * lwindows: entries for windows inside frames, whose `parent` is set
+ */
+void
+live_windows_find_frames(
+  xcw_state_t* state,
+  live_window_t** lwindows,
+  int lwindows_size)
+{
+  live_windows_t* live = state->live;
+  xcb_window_t* ancestors =
+    xcw_calloc(HEAP_WINDOWS, lwindows_size, sizeof(xcb_window_t));
+  xcb_query_tree_cookie_t* qtcs =
+    xcw_calloc(HEAP_WINDOWS, lwindows_size, sizeof(xcb_query_tree_cookie_t));
+  for (int i = 0; i < lwindows_size; i++)
+    ancestors[i] = lwindows[i]->parent;
+
+  for (int depth = 0; depth < MAX_FRAME_DEPTH; depth++) {
+    int unresolved = 0;
+    for (int i = 0; i < lwindows_size; i++) {
+      live_window_t* ancestor = live_windows_find(live, ancestors[i]);
+      if (ancestors[i] == XCB_NONE || ancestors[i] == state->xroot) {
+        ancestors[i] = XCB_NONE;
+      } else if (ancestor != NULL && !ancestor->in_frame) {
+        live_window_set_frame(live, lwindows[i], ancestors[i]);
+        ancestors[i] = XCB_NONE;
+      } else {
+        qtcs[i] = XCW_REQUEST(xcb_query_tree, state->xcon, ancestors[i]);
+        unresolved += 1;
+      }
+    }
+    if (unresolved == 0)
+      break;
+
+    for (int i = 0; i < lwindows_size; i++) {
+      if (ancestors[i] == XCB_NONE)
+        continue;
+      xcb_query_tree_reply_t* qtr =
+        XCW_REPLY(xcb_query_tree_reply, state->xcon, qtcs[i], NULL);
+      ancestors[i] = qtr == NULL ? XCB_NONE : qtr->parent;
+      free(qtr);
+    }
+  }
+
+  xcw_free(HEAP_WINDOWS, ancestors);
+  xcw_free(HEAP_WINDOWS, qtcs);
+}
+
+/**
+ * Read every out-of-date part of the live window table from the X server.  All
+ * requests for windows are sent before any reply is waited on; if nothing
+ * changed since the last refresh, this costs no round trips.
+ */
+void
+live_windows_refresh(xcw_state_t* state)
+{
+  live_windows_t* live = state->live;
+  if (!live->stale)
+    return;
+  // new managed windows are read along with everything else
+  if (live->managed_dirty)
+    live_windows_refresh_managed(state);
+
+  int dirty_capacity = live->size + live->managed_list_size;
+  live_window_t** dirty =
+    xcw_calloc(HEAP_WINDOWS, dirty_capacity, sizeof(live_window_t*));
+  int dirty_size = 0;
+  for (live_window_t* lw = live->bottom; lw != NULL; lw = lw->above) {
+    if (lw->dirty) {
+      dirty[dirty_size] = lw;
+      dirty_size += 1;
+    }
+  }
+  for (int i = 0; i < live->managed_list_size; i++) {
+    live_window_t* lw = live_windows_find(live, live->managed_list[i]);
+    if (lw != NULL && lw->in_frame && lw->dirty) {
+      dirty[dirty_size] = lw;
+      dirty_size += 1;
+    }
+  }
+
+  window_query_t* wqs =
+    xcw_calloc(HEAP_WINDOWS, dirty_size, sizeof(window_query_t));
+  xcb_get_geometry_cookie_t* ggcs =
+    xcw_calloc(HEAP_WINDOWS, dirty_size, sizeof(xcb_get_geometry_cookie_t));
+  xcb_get_property_cookie_t* gccs =
+    xcw_calloc(HEAP_WINDOWS, dirty_size, sizeof(xcb_get_property_cookie_t));
+  xcb_translate_coordinates_cookie_t* tccs = xcw_calloc(
+    HEAP_WINDOWS, dirty_size, sizeof(xcb_translate_coordinates_cookie_t));
+  xcb_query_tree_cookie_t* qtcs =
+    xcw_calloc(HEAP_WINDOWS, dirty_size, sizeof(xcb_query_tree_cookie_t));
+  for (int i = 0; i < dirty_size; i++) {
+    xcb_window_t window = dirty[i]->window;
+    // to hear about changes to the window's type, state and desktop, and for
+    // windows inside frames, to their geometry; the window may be destroyed
+    // before this arrives, which doesn't matter
+    uint32_t values[] = { XCB_EVENT_MASK_PROPERTY_CHANGE };
+    if (dirty[i]->in_frame)
+      values[0] |= XCB_EVENT_MASK_STRUCTURE_NOTIFY;
+    xcb_void_cookie_t cwac = XCW_REQUEST(
+      xcb_change_window_attributes_checked,
+      state->xcon,
+      window,
+      XCB_CW_EVENT_MASK,
+      values);
+    xcb_discard_reply(state->xcon, cwac.sequence);
+    wqs[i] = window_query(state, window);
+    ggcs[i] = XCW_REQUEST(xcb_get_geometry, state->xcon, window);
+    gccs[i] = XCW_REQUEST(xcb_icccm_get_wm_class, state->xcon, window);
+    if (dirty[i]->in_frame) {
+      tccs[i] =
+        XCW_REQUEST(
+          xcb_translate_coordinates, state->xcon, window, state->xroot, 0, 0);
+      qtcs[i] = XCW_REQUEST(xcb_query_tree, state->xcon, window);
+    }
+  }
+  xcb_get_property_cookie_t cdc = { 0 };
+  if (live->desktop_dirty)
+    cdc = current_desktop_request(state);
+
+  if (live->desktop_dirty) {
+    current_desktop_reply(state, cdc);
+    live->desktop_dirty = 0;
+  }
+
+  live_window_t** framed =
+    xcw_calloc(HEAP_WINDOWS, dirty_size, sizeof(live_window_t*));
+  int framed_size = 0;
+  for (int i = 0; i < dirty_size; i++) {
+    live_window_t* lwindow = dirty[i];
+    window_info_t info = window_query_reply(state, &(wqs[i]));
+    xcb_get_geometry_reply_t* ggr =
+      XCW_REPLY(xcb_get_geometry_reply, state->xcon, ggcs[i], NULL);
+    xcb_translate_coordinates_reply_t* tcr = NULL;
+    xcb_query_tree_reply_t* qtr = NULL;
+    if (lwindow->in_frame) {
+      tcr =
+        XCW_REPLY(xcb_translate_coordinates_reply, state->xcon, tccs[i], NULL);
+      qtr = XCW_REPLY(xcb_query_tree_reply, state->xcon, qtcs[i], NULL);
+    }
+    xcw_free(HEAP_WINDOWS, lwindow->window_class);
+    lwindow->window_class = icccm_window_class(state, gccs[i]);
+    int exists = (info.exists && ggr != NULL);
+    if (lwindow->in_frame)
+      exists = (exists && tcr != NULL && qtr != NULL);
+    if (exists) {
+      lwindow->mapped = info.map_state != XCB_MAP_STATE_UNMAPPED;
+      lwindow->override_redirect = info.override_redirect;
+      lwindow->type_normal = info.type_normal;
+      lwindow->hidden = info.hidden;
+      lwindow->desktop = info.desktop;
+      xcb_rectangle_t rect = { ggr->border_width + ggr->x,
+                               ggr->border_width + ggr->y,
+                               ggr->width,
+                               ggr->height };
+      if (lwindow->in_frame) {
+        // the origin of the window's contents, inside its border
+        rect.x = tcr->dst_x;
+        rect.y = tcr->dst_y;
+        lwindow->parent = qtr->parent;
+        lwindow->frame = XCB_NONE;
+        framed[framed_size] = lwindow;
+        framed_size += 1;
+      }
+      lwindow->rect = rect;
+      lwindow->dirty = 0;
+    } else {
+      // destroyed since it was added
+      live_windows_remove(live, lwindow->window);
+    }
+    free(ggr);
+    free(tcr);
+    free(qtr);
+  }
+  // after every top-level window is up to date
+  live_windows_find_frames(state, framed, framed_size);
+  live->stale = 0;
+
+  xcw_free(HEAP_WINDOWS, framed);
+  xcw_free(HEAP_WINDOWS, dirty);
+  xcw_free(HEAP_WINDOWS, wqs);
+  xcw_free(HEAP_WINDOWS, ggcs);
+  xcw_free(HEAP_WINDOWS, gccs);
+  xcw_free(HEAP_WINDOWS, tccs);
+  xcw_free(HEAP_WINDOWS, qtcs);
+}
+
+/**
+ * Start keeping the live window table up to date, and fill it.
+ */
+void
+live_windows_initialise(xcw_state_t* state)
+{
+  // select events before listing windows, so none are missed in between
+  uint32_t values[] = { XCB_EVENT_MASK_SUBSTRUCTURE_NOTIFY |
+                        XCB_EVENT_MASK_PROPERTY_CHANGE };
+  XCW_REQUEST(
+    xcb_change_window_attributes,
     state->xcon,
-    XCB_COPY_FROM_PARENT,
-    *win,
     state->xroot,
-    0,
-    0,
-    1,
-    1,
-    0,
-    XCB_WINDOW_CLASS_INPUT_OUTPUT,
-    XCB_COPY_FROM_PARENT,
-    mask,
+    XCB_CW_EVENT_MASK,
     values);
-  xorg_check_request(state->xcon, cwc, "create_window");
 
-  xcb_icccm_set_wm_class(
-    state->xcon, *win, sizeof(OVERLAY_WINDOW_CLASS), OVERLAY_WINDOW_CLASS);
-  xorg_window_move_resize(state->xcon, *win, x, y, w, h);
-  xcb_void_cookie_t mwc = xcb_map_window_checked(state->xcon, *win);
-  xorg_check_request(state->xcon, mwc, "map_window");
-  return win;
+  state->live = xcw_calloc(HEAP_WINDOWS, 1, sizeof(live_windows_t));
+  state->live->index = xid_table_create(0);
+  xcb_window_t* windows;
+  int windows_size;
+  xorg_get_windows(state, &windows, &windows_size);
+  for (int i = 0; i < windows_size; i++)
+    live_windows_add(state->live, windows[i]);
+  xcw_free(HEAP_WINDOWS, windows);
+  state->live->managed_dirty = 1;
+  state->live->desktop_dirty = 1;
+  state->live->stale = 1;
+  live_windows_refresh(state);
 }
 
 /**
- * Create a graphics context for drawing the background of an overlay window.
- *
- * win: the overlay window
+ * Make a tracked window from an entry in the live window table.
  */
-xcb_gcontext_t*
-overlay_get_bg_gc(xcb_connection_t* xcon, xcb_window_t win)
+tracked_window_t
+live_window_tracked(live_window_t* lwindow)
 {
-  xcb_gcontext_t* gc = malloc(sizeof(xcb_gcontext_t));
-  *gc = xcb_generate_id(xcon);
-  uint32_t mask = XCB_GC_FOREGROUND;
-  uint32_t value_list[] = { BG_COLOUR };
-  xcb_void_cookie_t cgc =
-    (xcb_create_gc_checked(xcon, *gc, win, mask, value_list));
-  xorg_check_request(xcon, cgc, "create_gc");
-  return gc;
+  char* window_class = lwindow->window_class == NULL
+                         ? NULL
+                         : xcw_strdup(HEAP_WINDOWS, lwindow->window_class);
+  tracked_window_t twindow = { lwindow->window, lwindow->rect, window_class };
+  return twindow;
+}
+
+/**
+ * Determine whether an entry in the live window table should be tracked, like
+ * `window_info_normal`.
+ */
+int
+live_window_normal(xcw_state_t* state, live_window_t* lwindow)
+{
+  int mapped = lwindow->mapped;
+  // a window inside a frame is only visible if the frame is mapped
+  if (lwindow->in_frame && lwindow->frame != XCB_NONE) {
+    live_window_t* frame = live_windows_find(state->live, lwindow->frame);
+    mapped = (mapped && frame != NULL && frame->mapped);
+  }
+  return (mapped && !lwindow->override_redirect &&
+          lwindow->type_normal && !lwindow->hidden &&
+          window_desktop_current(state, lwindow->desktop));
 }
 
 /**
- * Create a graphics context for drawing the text of an overlay window.
+ * Get the windows to track from the live window table, like
+ * `initialise_tracked_windows`.  Managed windows inside frames, as with
+ * reparenting window managers, are in the table too, so this costs no round
+ * trips unless the table is out of date.
  *
- * win: the overlay window
+ * windows (output): tracked windows
+ * windows_size (output): size of `windows`
  */
-xcb_gcontext_t*
-overlay_get_font_gc(xcw_state_t* state, xcb_window_t win)
+void
+live_windows_tracked(
+  xcw_state_t* state,
+  tracked_window_t** windows,
+  int* windows_size)
 {
-  xcb_gcontext_t* gc = malloc(sizeof(xcb_gcontext_t));
-  *gc = xcb_generate_id(state->xcon);
-  uint32_t mask = XCB_GC_FOREGROUND | XCB_GC_BACKGROUND | XCB_GC_FONT;
-  uint32_t value_list[] = { FG_COLOUR, BG_COLOUR, state->overlay_font };
-  xcb_void_cookie_t cgc =
-    (xcb_create_gc_checked(state->xcon, *gc, win, mask, value_list));
-  xorg_check_request(state->xcon, cgc, "create_gc");
-  return gc;
+  live_windows_refresh(state);
+  live_windows_t* live = state->live;
+  int size = 0;
+
+  if (live->managed == NULL) {
+    *windows = xcw_calloc(HEAP_WINDOWS, live->size, sizeof(tracked_window_t));
+    for (live_window_t* lwindow = live->bottom; lwindow != NULL;
+         lwindow = lwindow->above) {
+      if (
+        live_window_normal(state, lwindow) &&
+        window_candidate(state, lwindow->window, NULL)) {
+        (*windows)[size] = live_window_tracked(lwindow);
+        size += 1;
+      }
+    }
+    *windows_size = size;
+    return;
+  }
+
+  // keep the window manager's order
+  *windows = xcw_calloc(
+    HEAP_WINDOWS, live->managed_list_size, sizeof(tracked_window_t));
+  for (int i = 0; i < live->managed_list_size; i++) {
+    xcb_window_t window = live->managed_list[i];
+    live_window_t* lwindow = live_windows_find(live, window);
+    if (
+      lwindow != NULL && live_window_normal(state, lwindow) &&
+      window_candidate(state, window, NULL)) {
+      (*windows)[size] = live_window_tracked(lwindow);
+      size += 1;
+    }
+  }
+  *windows_size = size;
+}
+
+/**
+ * Update the live window table from an event on the root window, or on a
+ * managed window inside a frame.
+ */
+void
+handle_live_event(xcw_state_t* state, xcb_generic_event_t* event)
+{
+  live_windows_t* live = state->live;
+  switch (event->response_type & ~0x80) {
+    case XCB_CREATE_NOTIFY: {
+      xcb_create_notify_event_t* cn = (xcb_create_notify_event_t*)event;
+      if (cn->parent == state->xroot && !live_windows_own(state, cn->window))
+        live_windows_add(live, cn->window);
+      break;
+    }
+    case XCB_DESTROY_NOTIFY: {
+      live_windows_remove(live, ((xcb_destroy_notify_event_t*)event)->window);
+      break;
+    }
+    case XCB_REPARENT_NOTIFY: {
+      xcb_reparent_notify_event_t* rn = (xcb_reparent_notify_event_t*)event;
+      live_window_t* lwindow = live_windows_find(live, rn->window);
+      if (rn->event != state->xroot) {
+        // moved within its frame, or to another one; windows moved to the
+        // root window are handled by the root window's event
+        if (
+          lwindow != NULL && lwindow->in_frame && rn->parent != state->xroot) {
+          lwindow->parent = rn->parent;
+          live_window_dirty(live, lwindow);
+        }
+      } else if (rn->parent == state->xroot) {
+        if (lwindow != NULL && lwindow->in_frame)
+          live_windows_remove(live, rn->window);
+        live_windows_add(live, rn->window);
+      } else {
+        live_windows_remove(live, rn->window);
+        // already managed, so it won't be added with `_NET_CLIENT_LIST`
+        if (
+          live->managed != NULL &&
+          xid_table_contains(live->managed, rn->window))
+          live_windows_add_framed(live, rn->window);
+      }
+      break;
+    }
+    case XCB_MAP_NOTIFY: {
+      live_window_t* lwindow =
+        live_windows_find(live, ((xcb_map_notify_event_t*)event)->window);
+      // the window type is usually set just before mapping
+      if (lwindow != NULL)
+        live_window_dirty(live, lwindow);
+      break;
+    }
+    case XCB_UNMAP_NOTIFY: {
+      xcb_unmap_notify_event_t* un = (xcb_unmap_notify_event_t*)event;
+      live_window_t* lwindow = live_windows_find(live, un->window);
+      if (lwindow != NULL)
+        lwindow->mapped = 0;
+      break;
+    }
+    case XCB_CONFIGURE_NOTIFY: {
+      xcb_configure_notify_event_t* cn = (xcb_configure_notify_event_t*)event;
+      live_window_t* lwindow = live_windows_find(live, cn->window);
+      if (lwindow == NULL)
+        break;
+      if (lwindow->in_frame) {
+        live_window_configure(live, lwindow, cn);
+        break;
+      }
+      xcb_rectangle_t rect = { cn->border_width + cn->x,
+                               cn->border_width + cn->y,
+                               cn->width,
+                               cn->height };
+      lwindow->rect = rect;
+      lwindow->override_redirect = cn->override_redirect;
+      live_window_frame_moved(live, lwindow);
+      live_windows_restack(live, cn->window, cn->above_sibling);
+      break;
+    }
+    case XCB_CIRCULATE_NOTIFY: {
+      xcb_circulate_notify_event_t* cn = (xcb_circulate_notify_event_t*)event;
+      xcb_window_t top = XCB_NONE;
+      if (cn->place == XCB_PLACE_ON_TOP && live->top != NULL)
+        top = live->top->window;
+      live_windows_restack(live, cn->window, top);
+      break;
+    }
+    case XCB_PROPERTY_NOTIFY: {
+      xcb_property_notify_event_t* pn = (xcb_property_notify_event_t*)event;
+      xcb_ewmh_connection_t* ewmh = &(state->ewmh);
+      if (pn->window == state->xroot) {
+        if (pn->atom == ewmh->_NET_CLIENT_LIST)
+          live->managed_dirty = 1;
+        else if (pn->atom == ewmh->_NET_CURRENT_DESKTOP)
+          live->desktop_dirty = 1;
+        live->stale =
+          (live->stale || live->managed_dirty || live->desktop_dirty);
+        break;
+      }
+      live_window_t* lwindow = live_windows_find(live, pn->window);
+      if (
+        lwindow != NULL && (pn->atom == ewmh->_NET_WM_WINDOW_TYPE ||
+                            pn->atom == ewmh->_NET_WM_STATE ||
+                            pn->atom == ewmh->_NET_WM_DESKTOP))
+        live_window_dirty(live, lwindow);
+      break;
+    }
+  }
 }
 
 /**
- * Set the text on an overlay window.  `xcb_flush` should be called after
- * calling this function.
- *
- * wsetup: containing the overlay window (if there is no overlay window, this
- *     function does nothing)
- * text: text to render (null-terminated, must be at most 255 characters)
+ * Make adjustments to tracking windows based on a keypress event.  Ends the
+ * session if this chooses a window.  Does nothing unless a session is active
+ * and has acquired the keyboard grab.  In `--multi` mode, the session only ends
+ * on a key in `END_KEYSYMS`, and other non-matching keys go back to the top
+ * level.
  */
 void
-overlay_set_text(xcw_state_t* state, window_setup_t* wsetup, char* text)
+handle_keypress(xcw_state_t* state, xcb_key_press_event_t* kp)
 {
-  if (wsetup->overlay_window == NULL)
+  // keys pressed before the grab, or queued after the session ended, went to
+  // another window as far as the user is concerned
+  if (!state->grab.grabbed || state->wsetups == NULL)
     return;
-  xcb_window_t win = *(wsetup->overlay_window);
-
-  if (wsetup->overlay_bg_gc == NULL) {
-    wsetup->overlay_bg_gc = overlay_get_bg_gc(state->xcon, win);
-  }
-  if (wsetup->overlay_font_gc == NULL) {
-    wsetup->overlay_font_gc = overlay_get_font_gc(state, win);
+  // the setup structure at index `i` at every level is for `ksl[i]`
+  int index = state->keycode_ksl[kp->detail];
+  // don't count the time spent waiting for the key
+  timings_skip();
+
+  if (
+    state->input->multi && index != KEYCODE_END &&
+    (index < 0 || index >= state->wsetups_size)) {
+    wsetups_reset(state);
+  } else if (index < 0 || index >= state->wsetups_size) {
+    session_end(state, XCB_NONE);
+  } else {
+    wsetups_descend_by_index(state, index);
   }
-
-  xcb_poly_fill_rectangle(
-    state->xcon, win, *(wsetup->overlay_bg_gc), 1, wsetup->overlay_rect);
-  xorg_draw_text_centred(
-    state->xcon,
-    win,
-    wsetup->overlay_rect,
-    *(wsetup->overlay_font_gc),
-    text,
-    state->input->font_size,
-    state->input->font_path);
 }
 
 /**
- * See `overlays_set_text`.  `xcb_flush` should be called after calling * this
- * function.
+ * Wait for the next event from the X server.  Pending requests are flushed
+ * before sleeping, and the process sleeps on the connection rather than
+ * polling it, so it uses no CPU while idle.
  *
- * wsetups: array of setup structures containing overlay windows to render text
- *     on (recursively)
- * text: prefix to text rendered to every overlay window (null-terminated)
+ * timeout: maximum time to wait in milliseconds, or -1 to wait indefinitely
+ *
+ * When running as a daemon, this also wakes up for clients connecting to the
+ * daemon socket.  The keyboard grab is acquired while waiting.
+ *
+ * returns: the event (to be freed by the caller), or NULL if `timeout` passed
+ *     or a client is waiting to be accepted, without an event arriving
  */
-void
-_overlays_set_text(
-  xcw_state_t* state,
-  window_setup_t* wsetups,
-  int wsetups_size,
-  char* text)
+xcb_generic_event_t*
+xorg_wait_for_event(xcw_state_t* state, int timeout)
 {
-  int text_size = strlen(text);
-  // there's no way we're every going to reach 255 characters with the
-  // current setup; this is just in case extra static text gets added
-  if (text_size + 1 > 255) {
-    xcw_warn("refusing to render text longer than 255 characters\n");
-  } else
-    for (int i = 0; i < wsetups_size; i++) {
-      window_setup_t* wsetup = &(wsetups[i]);
-      // next level down is 1 character longer, plus 1 for null
-      char* new_text = calloc(text_size + 2, sizeof(char));
-      strcpy(new_text, text);
-      new_text[text_size] = wsetup->character;
-      new_text[text_size + 1] = '\0';
-
-      overlay_set_text(state, wsetup, new_text);
-      if (wsetup->children != NULL) {
-        _overlays_set_text(
-          state, wsetup->children, wsetup->children_size, new_text);
-      }
+  int64_t deadline = timeout < 0 ? -1 : monotonic_ms() + timeout;
+  struct pollfd pfds[] = { { xcb_get_file_descriptor(state->xcon), POLLIN, 0 },
+                           { state->listen_fd, POLLIN, 0 } };
+  // a negative fd is ignored by `poll`
+  int pfds_size = sizeof(pfds) / sizeof(*pfds);
+  xcb_generic_event_t* event;
 
-      free(new_text);
+  // events may already have been read while waiting for replies
+  while (!(event = xcb_poll_for_queued_event(state->xcon))) {
+    input_grab_update(state);
+    xcb_flush(state->xcon);
+
+    int remain = deadline < 0 ? -1 : max(deadline - monotonic_ms(), 0);
+    int retry = input_grab_timeout(state);
+    if (retry >= 0 && (remain < 0 || retry < remain))
+      remain = retry;
+    int ready = poll(pfds, pfds_size, remain);
+    if (ready < 0) {
+      if (errno == EINTR)
+        continue;
+      xcw_die("poll: %s\n", strerror(errno));
+    } else if (pfds[1].revents & POLLIN) {
+      return NULL;
+    } else if (ready == 0) {
+      if (deadline >= 0 && monotonic_ms() >= deadline)
+        return NULL;
+      continue;
     }
+
+    if ((event = xcb_poll_for_event(state->xcon)))
+      break;
+    if (xcb_connection_has_error(state->xcon))
+      xcw_die("connection to the X server lost\n");
+  }
+
+  // the grab's reply comes before keys sent to the grab, and may have been read
+  // along with them
+  input_grab_update(state);
+  return event;
 }
 
 /**
- * Update text on all overlay windows.
+ * Repaint an overlay window in response to an exposure.  A series of exposures
+ * is merged into a single repaint of the area covering all of them.
  */
 void
-overlays_set_text(xcw_state_t* state)
+handle_expose(xcw_state_t* state, xcb_expose_event_t* event)
 {
-  char* text = "";
-  _overlays_set_text(state, state->wsetups, state->wsetups_size, text);
-  xcb_flush(state->xcon);
-}
+  for (int i = 0; i < state->shared_overlays_size; i++) {
+    shared_overlay_t* overlay = &(state->shared_overlays[i]);
+    // every label is redrawn in one pass anyway
+    if (overlay->window == event->window && event->count == 0)
+      shared_overlay_paint(state, overlay);
+  }
 
-// -- wsetup utilities
+  window_setup_t* wsetup = xid_table_get(state->overlays, event->window);
+  if (wsetup == NULL)
+    return;
+
+  xcb_rectangle_t area = { event->x, event->y, event->width, event->height };
+  rect_union(&(wsetup->overlay_damage), &area);
+  // more exposures for this window follow
+  if (event->count > 0)
+    return;
+
+  overlay_paint(state, wsetup, &(wsetup->overlay_damage));
+  xcb_rectangle_t none = { 0, 0, 0, 0 };
+  wsetup->overlay_damage = none;
+}
 
 /**
- * Create a bottom-level `wsetup_t`.
- *
- * window: the window to track
- * character: bottom-level character in the window label
+ * Respond to an event from the X server.  Ends the session if this chooses a
+ * window.
  */
-window_setup_t
-initialise_window_setup(xcw_state_t* state, xcb_window_t window, char character)
+void
+handle_event(xcw_state_t* state, xcb_generic_event_t* event)
 {
-  // an xcb_window_t is an xcb_drawable_t
-  xcb_get_geometry_cookie_t ggc = xcb_get_geometry(state->xcon, window);
-  xcb_get_geometry_reply_t* ggr;
-  if (!(ggr = xcb_get_geometry_reply(state->xcon, ggc, NULL))) {
-    xcw_die("get_geometry\n");
+  switch (event->response_type & ~0x80) {
+    case 0: {
+      xcb_generic_error_t* evterr = (xcb_generic_error_t*)event;
+      char* name =
+        xorg_tracked_request(&(state->requests), evterr->full_sequence);
+      if (name != NULL)
+        xcw_die("%s (%d)\n", name, evterr->error_code);
+      xcw_die("event loop error: %d (request %d.%d, sequence %u)\n",
+              evterr->error_code,
+              evterr->major_code,
+              evterr->minor_code,
+              evterr->full_sequence);
+      break;
+    }
+    case XCB_EXPOSE: {
+      handle_expose(state, (xcb_expose_event_t*)event);
+      break;
+    }
+    case XCB_KEY_PRESS: {
+      handle_keypress(state, (xcb_key_press_event_t*)event);
+      break;
+    }
+    case XCB_MAPPING_NOTIFY: {
+      // the keyboard layout may change while running as a daemon
+      xcb_refresh_keyboard_mapping(
+        state->ksymbols, (xcb_mapping_notify_event_t*)event);
+      input_keymap_initialise(state);
+      break;
+    }
+    default: {
+      if (monitors_changed(state, event))
+        monitors_initialise(state);
+      else if (state->live != NULL)
+        handle_live_event(state, event);
+      break;
+    }
   }
-
-  xcb_rectangle_t rect = { 0, 0, ggr->width, ggr->height };
-  xcb_rectangle_t* rectp = malloc(sizeof(xcb_rectangle_t));
-  *rectp = rect;
-  // guaranteed that ksl_size <= windows_size
-  xcb_window_t* overlay_window = overlay_create(
-    state,
-    ggr->border_width + ggr->x,
-    ggr->border_width + ggr->y,
-    rect.width,
-    rect.height);
-  xcb_window_t* window_p = malloc(sizeof(xcb_window_t));
-  *window_p = window;
-
-  window_setup_t wsetup = { overlay_window, NULL,      NULL, rectp,
-                            window_p,       character, NULL, 0 };
-  return wsetup;
 }
 
+// -- sessions
+
 /**
- * See `initialise_window_tracking`.
- *
- * remain_depth: number of nested levels remaining (we choose a character in
- * the string to type at every level; if 0, we choose the last character)
+ * Start choosing a window: start grabbing the keyboard and draw labels over
+ * every tracked window.  The session may end immediately if there are fewer
+ * than two windows to choose from.
  */
 void
-_initialise_window_tracking(
-  xcw_state_t* state,
-  int remain_depth,
-  xcb_window_t* windows,
-  int windows_size,
-  window_setup_t** wsetups,
-  int* wsetups_size)
+session_start(xcw_state_t* state)
 {
-  if (remain_depth == 0) {
-    *wsetups = calloc(windows_size, sizeof(window_setup_t));
-    *wsetups_size = windows_size;
-    for (int i = 0; i < windows_size; i++) {
-      // guaranteed that ksl_size <= windows_size
-      (*wsetups)[i] = initialise_window_setup(
-        state, windows[i], state->input->ksl[i].character);
+  if (state->live != NULL) {
+    // bring the table up to date with events that haven't been handled yet
+    xcb_generic_event_t* event;
+    while ((event = xcb_poll_for_event(state->xcon))) {
+      handle_event(state, event);
+      free(event);
     }
+  }
+  state->chosen = 0;
+  initialise_input(state);
+  timings_phase("initialise_input");
+
+  tracked_window_t* windows;
+  int windows_size;
+  if (state->live != NULL) {
+    live_windows_tracked(state, &windows, &windows_size);
   } else {
-    // base number of windows 'used up' per iteration
-    int p = windows_size / state->input->ksl_size;
-    // number of iterations to use one extra window
-    int r = windows_size % state->input->ksl_size;
-    // required number of iterations to use all windows
-    int n = p > 0 ? state->input->ksl_size : r;
-    *wsetups = calloc(n, sizeof(window_setup_t));
-    *wsetups_size = n;
-    xcb_window_t* remain_windows = windows;
-
-    for (int i = 0; i < n; i++) {
-      window_setup_t* children = NULL;
-      int children_size;
-      int children_windows_size = i < r ? p + 1 : p;
-
-      if (children_windows_size == 1) {
-        (*wsetups)[i] = initialise_window_setup(
-          state, *remain_windows, state->input->ksl[i].character);
-      } else {
-        _initialise_window_tracking(
-          state,
-          remain_depth - 1,
-          remain_windows,
-          children_windows_size,
-          &children,
-          &children_size);
-        window_setup_t wsetup = { NULL,     NULL,
-                                  NULL,     NULL,
-                                  NULL,     state->input->ksl[i].character,
-                                  children, children_size };
-        (*wsetups)[i] = wsetup;
-      }
+    initialise_tracked_windows(state, &windows, &windows_size);
+  }
+  tracked_windows_clip(state, windows, &windows_size);
+  timings_phase("initialise_tracked_windows");
+  // the glyphs were rasterised while finding windows
+  glyph_cache_finish(state);
+  timings_phase("glyph_cache_finish");
+  initialise_window_tracking(state, windows, windows_size);
+  tracked_windows_free(windows, windows_size);
+  timings_phase("initialise_window_tracking");
 
-      remain_windows += children_windows_size;
-    }
+  if (state->wsetups_size == 0) {
+    session_end(state, XCB_NONE);
+  } else if (state->wsetups_size == 1 && !state->input->multi) {
+    wsetup_choose(state, &(state->wsetups[0]));
+  } else {
+    overlays_set_text(state);
+    timings_sync(state->input, state->xcon);
+    timings_phase("overlays_set_text");
   }
 }
 
 /**
- * Construct data for tracked windows in a nested structure matching the
- * characters that need to be typed to choose them.
- *
- * state: the result is stored in here
- * windows: tracked windows
+ * Print a window chosen in `--multi` mode without ending the session.  The
+ * line is flushed straight away, so a consumer can act on each window as it's
+ * chosen.  As a daemon, the line is sent to the client instead.
  */
 void
-initialise_window_tracking(
-  xcw_state_t* state,
-  xcb_window_t* windows,
-  int windows_size)
+session_output(xcw_state_t* state, xcb_window_t window)
 {
-  _initialise_window_tracking(
-    state,
-    // the length of each tracking string
-    (int)(log(max(windows_size - 1, 1)) / log(state->input->ksl_size)),
-    windows,
-    windows_size,
-    &(state->wsetups),
-    &(state->wsetups_size));
+  char line[SOCKET_LINE_SIZE];
+  format_window(state->input, window, line, sizeof(line));
+  if (state->listen_fd < 0) {
+    fputs(line, stdout);
+    fflush(stdout);
+  } else {
+    // the client may have gone away, which isn't our problem
+    send(state->client_fd, line, strlen(line), MSG_NOSIGNAL);
+  }
+  state->chosen++;
+  timings_phase("keypress_to_output");
 }
 
 /**
- * See `wsetup_debug_print`.
+ * Finish choosing a window.  Outside of daemon mode, this prints the result and
+ * exits the process.  As a daemon, the result is sent to the client, and every
+ * overlay and the keyboard grab are released, ready for the next session.
  *
- * depth: current depth in the structure, starting at 0, used for indentation
+ * window: the chosen window, or `XCB_NONE` if none was chosen (or the windows
+ *     chosen in `--multi` mode have already been printed)
  */
 void
-_wsetup_debug_print(window_setup_t* wsetup, int depth)
+session_end(xcw_state_t* state, xcb_window_t window)
 {
-  printf("[wsetup] ");
-  for (int i = 0; i < depth; i++)
-    printf("  ");
-  printf("%c", wsetup->character);
-  if (wsetup->window == NULL)
-    printf("\n");
-  else
-    printf(" %x\n", *(wsetup->window));
+  timings_phase("keypress_to_exit");
+  if (state->listen_fd < 0) {
+    timings_print(state->input, state->xcon);
+    stats_print(state->input, state->xcon);
+    if (window != XCB_NONE)
+      choose_window(state->input, window);
+    if (state->chosen > 0)
+      xcw_exit_match();
+    xcw_exit_no_match();
+  }
 
-  if (wsetup->children != NULL) {
-    for (int i = 0; i < wsetup->children_size; i++) {
-      _wsetup_debug_print(&(wsetup->children[i]), depth + 1);
-    }
+  char line[SOCKET_LINE_SIZE];
+  line[0] = '\n';
+  line[1] = '\0';
+  if (window != XCB_NONE)
+    format_window(state->input, window, line, sizeof(line));
+  // an empty line means no match, which isn't true once a window was chosen
+  if (window != XCB_NONE || state->chosen == 0) {
+    // the client may have gone away, which isn't our problem
+    send(state->client_fd, line, strlen(line), MSG_NOSIGNAL);
   }
+  close(state->client_fd);
+  state->client_fd = -1;
+
+  // in `--multi` mode, levels other than the current one are still allocated
+  for (int i = 0; i < state->root_wsetups_size; i++)
+    wsetup_free(state, &(state->root_wsetups[i]));
+  wsetup_arena_free(&(state->wsetup_arena));
+  state->wsetups = NULL;
+  state->wsetups_size = 0;
+  state->root_wsetups = NULL;
+  state->root_wsetups_size = 0;
+  shared_overlays_free(state);
+  input_grab_release(state);
+  xcb_flush(state->xcon);
+  timings_print(state->input, state->xcon);
+  stats_print(state->input, state->xcon);
 }
 
-/**
- * Print a setup structure to stdout.
- */
-void
-wsetup_debug_print(window_setup_t* wsetup)
-{
-  _wsetup_debug_print(wsetup, 0);
-}
+// -- daemon
 
 /**
- * Destroy all overlay windows in a setup structure and free the structure's
- * used memory.
+ * Determine the path of the daemon socket if the `--socket` option wasn't
+ * given: `SOCKET_NAME` in `$XDG_RUNTIME_DIR`, or in `/tmp` with the user ID.
  */
 void
-wsetup_free(xcb_connection_t* xcon, window_setup_t* wsetup)
+daemon_socket_path_initialise(xcw_input_t* input)
 {
-  xcb_window_t* w = wsetup->overlay_window;
-  if (w != NULL) {
-    xcb_destroy_window_checked(xcon, *w);
-    free(wsetup->overlay_rect);
-  }
-  if (wsetup->overlay_bg_gc != NULL) {
-    xcb_free_gc(xcon, *(wsetup->overlay_bg_gc));
-    free(wsetup->overlay_bg_gc);
-  }
-  if (wsetup->overlay_font_gc != NULL) {
-    xcb_free_gc(xcon, *(wsetup->overlay_font_gc));
-    free(wsetup->overlay_font_gc);
-  }
-
-  if (wsetup->children != NULL) {
-    for (int i = 0; i < wsetup->children_size; i++) {
-      window_setup_t* child = &(wsetup->children[i]);
-      wsetup_free(xcon, child);
-    }
-    free(wsetup->children);
-  }
-
-  xcb_flush(xcon);
+  if (input->socket_path != NULL)
+    return;
+  char* dir = getenv("XDG_RUNTIME_DIR");
+  struct sockaddr_un address;
+  char path[sizeof(address.sun_path)];
+  if (dir != NULL && dir[0] != '\0')
+    snprintf(path, sizeof(path), "%s/%s", dir, SOCKET_NAME);
+  else
+    snprintf(path, sizeof(path), "/tmp/%d-%s", getuid(), SOCKET_NAME);
+  input->socket_path = xcw_strdup(HEAP_OTHER, path);
 }
 
 /**
- * Choose the window in a setup structure or replace the current array of setup
- * structures with its children.  Updates text rendered on overlay windows.
- * Exits the process if a window is chosen.
+ * Build the address of the daemon socket.
  */
-void
-wsetup_choose(xcw_state_t* state, window_setup_t* wsetup)
+struct sockaddr_un
+daemon_address(xcw_input_t* input)
 {
-  if (wsetup->window != NULL && wsetup->children_size == 0) {
-    choose_window(state->input, *(wsetup->window));
-  } else {
-    state->wsetups = wsetup->children;
-    state->wsetups_size = wsetup->children_size;
-    overlays_set_text(state);
-  }
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (strlen(input->socket_path) >= sizeof(address.sun_path))
+    xcw_fail(EX_USAGE, "socket path too long: %s\n", input->socket_path);
+  strcpy(address.sun_path, input->socket_path);
+  return address;
 }
 
 /**
- * Reduce a setup structure by choosing an item.  Frees removed parts of the
- * structure.
- *
- * index: array index in `wsetups` to choose
+ * Start accepting clients on the daemon socket.  Fails if another daemon is
+ * already listening on it; a socket left behind by a daemon that has gone is
+ * replaced.
  */
 void
-wsetups_descend_by_index(xcw_state_t* state, int index)
+daemon_listen(xcw_state_t* state)
 {
-  // state changes during iteration
-  window_setup_t* wsetups = state->wsetups;
-  int wsetups_size = state->wsetups_size;
-  for (int i = 0; i < wsetups_size; i++) {
-    if (i == index)
-      wsetup_choose(state, &(wsetups[i]));
-    else
-      wsetup_free(state->xcon, &(wsetups[i]));
-  }
+  struct sockaddr_un address = daemon_address(state->input);
+  int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  // not blocking, since the main loop also wakes up when no client is waiting
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+  if (probe < 0 || fd < 0)
+    xcw_die("socket: %s\n", strerror(errno));
+
+  if (connect(probe, (struct sockaddr*)&address, sizeof(address)) == 0)
+    xcw_die("a daemon is already running on %s\n", address.sun_path);
+  close(probe);
+  unlink(address.sun_path);
+  if (bind(fd, (struct sockaddr*)&address, sizeof(address)) < 0)
+    xcw_die("bind %s: %s\n", address.sun_path, strerror(errno));
+  if (listen(fd, 8) < 0)
+    xcw_die("listen: %s\n", strerror(errno));
+  state->listen_fd = fd;
 }
 
 /**
- * Reduce a setup structure by choosing a character, then reduce recursively
- * like `wsetups_descend_by_index`.  Exits the process if the character doesn't
- * correspond to any options.  Frees removed parts of the structure.
+ * Read a line sent by a client, waiting at most a second for it.
  *
- * c: character to choose
+ * line (output): null-terminated line, without the newline
+ * size: size of `line`
+ *
+ * returns: whether a whole line was read
  */
-void
-wsetups_descend_by_char(xcw_state_t* state, char c)
+int
+daemon_read_line(int fd, char* line, int size)
 {
-  int index = -1;
-  for (int i = 0; i < state->wsetups_size; i++) {
-    if (state->wsetups[i].character == c) {
-      index = i;
-      break;
+  struct pollfd pfd = { fd, POLLIN, 0 };
+  int length = 0;
+  while (length < size - 1 && poll(&pfd, 1, 1000) > 0) {
+    int count = recv(fd, line + length, size - 1 - length, 0);
+    if (count <= 0)
+      return 0;
+    length += count;
+    line[length] = '\0';
+    char* newline = strchr(line, '\n');
+    if (newline != NULL) {
+      *newline = '\0';
+      return 1;
     }
   }
-
-  if (index == -1)
-    xcw_exit_no_match();
-  else
-    wsetups_descend_by_index(state, index);
+  return 0;
 }
 
-// -- program
-
 /**
- * Get the windows to track.
- *
- * windows (output): window IDs
- * windows_size (output): size of `windows`
+ * Accept a client connecting to the daemon socket and act on its command.  The
+ * only command is `select`, which starts a session; the chosen window is sent
+ * back when it ends, or an empty line if none is chosen.  Clients connecting
+ * while a session is active are sent an empty line.
  */
 void
-initialise_tracked_windows(
-  xcw_state_t* state,
-  xcb_window_t** windows,
-  int* windows_size)
+daemon_accept(xcw_state_t* state)
 {
-  xcb_window_t* all_windows;
-  int all_windows_size;
-  xorg_get_windows(state, &all_windows, &all_windows_size);
-  int managed_windows_defined;
-  xcb_window_t* managed_windows;
-  int managed_windows_size;
-  xorg_get_managed_windows(
-    state, &managed_windows_defined, &managed_windows, &managed_windows_size);
+  int fd = accept(state->listen_fd, NULL, NULL);
+  if (fd < 0)
+    return;
 
-  *windows = calloc(all_windows_size, sizeof(xcb_window_t));
-  int size = 0;
-  for (int i = 0; i < all_windows_size; i++) {
-    if (
-      // ignore if not managed by the window manager
-      !(managed_windows_defined &&
-        !xorg_window_managed(
-          all_windows[i], managed_windows, managed_windows_size)) &&
-
-      // only include if whitelisted
-      (state->input->whitelist_size == 0 || xorg_contains_window(
-                                              state->input->whitelist,
-                                              state->input->whitelist_size,
-                                              all_windows[i])) &&
-
-      // ignore if blacklisted
-      !xorg_contains_window(
-        state->input->blacklist,
-        state->input->blacklist_size,
-        all_windows[i]) &&
-
-      xorg_window_normal(state->xcon, all_windows[i]) &&
-
-      ewmh_window_normal(state, all_windows[i])) {
-      (*windows)[size] = all_windows[i];
-      size += 1;
-    }
+  char line[SOCKET_LINE_SIZE];
+  if (
+    state->client_fd >= 0 || !daemon_read_line(fd, line, sizeof(line)) ||
+    strcmp(line, "select") != 0) {
+    send(fd, "\n", 1, MSG_NOSIGNAL);
+    close(fd);
+    return;
   }
-  *windows = realloc(*windows, size * sizeof(xcb_window_t));
-  *windows_size = size;
 
-  if (managed_windows_defined)
-    free(managed_windows);
-  free(all_windows);
+  state->client_fd = fd;
+  timings_skip();
+  session_start(state);
 }
 
 /**
- * Make adjustments to tracking windows based on a keypress event.  Exits the
- * process if this chooses a window.
+ * Ask a running daemon to choose a window, print the result like choosing
+ * directly would, and exit the process.
  */
 void
-handle_keypress(xcw_state_t* state, xcb_key_press_event_t* kp)
+daemon_trigger(xcw_input_t* input)
 {
-  xcb_keysym_t ksym = xcb_key_press_lookup_keysym(state->ksymbols, kp, 0);
-  keysyms_lookup_t* ksl_item = (keysyms_lookup_find_keysym(
-    state->input->ksl, state->input->ksl_size, ksym));
-
-  if (ksl_item == NULL) {
-    xcw_exit_no_match();
-  } else {
-    wsetups_descend_by_char(state, ksl_item->character);
+  struct sockaddr_un address = daemon_address(input);
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    xcw_die("socket: %s\n", strerror(errno));
+  if (connect(fd, (struct sockaddr*)&address, sizeof(address)) < 0)
+    xcw_die("connect %s: %s\n", address.sun_path, strerror(errno));
+  char* command = "select\n";
+  if (send(fd, command, strlen(command), MSG_NOSIGNAL) < 0)
+    xcw_die("send: %s\n", strerror(errno));
+
+  // the daemon replies with one line once the session ends, or in `--multi`
+  // mode, a line as each window is chosen; a lone empty line means no match
+  char buffer[SOCKET_LINE_SIZE];
+  int length = 0;
+  int count;
+  while ((count = recv(fd, buffer, sizeof(buffer), 0)) > 0) {
+    char* data = buffer;
+    if (length == 0 && data[0] == '\n') {
+      data++;
+      count--;
+    }
+    fwrite(data, 1, count, stdout);
+    fflush(stdout);
+    length += count;
   }
+  close(fd);
+
+  if (length > 0)
+    xcw_exit_match();
+  xcw_exit_no_match();
 }
 
 /**
@@ -1365,19 +6373,26 @@ parse_arg_characters(
 {
   // we won't put more than `char_pool` items in `ksl`
   int pool_size = strlen(char_pool);
-  input->ksl = calloc(pool_size, sizeof(keysyms_lookup_t));
+  input->ksl = xcw_calloc(HEAP_OTHER, pool_size, sizeof(keysyms_lookup_t));
   int size = 0;
 
+  // index the allowed characters and the ones already used by character
+  keysyms_lookup_t* allowed[256] = { NULL };
+  int used[256] = { 0 };
+  for (int i = 0; i < ALL_KEYSYMS_LOOKUP_SIZE; i++)
+    allowed[(unsigned char)ALL_KEYSYMS_LOOKUP[i].character] =
+      &(ALL_KEYSYMS_LOOKUP[i]);
+
   // check validity of characters, compile lookup
   for (int i = 0; i < pool_size; i++) {
-    char c = char_pool[i];
-    keysyms_lookup_t* ksl_item =
-      keysyms_lookup_find_char(ALL_KEYSYMS_LOOKUP, ALL_KEYSYMS_LOOKUP_SIZE, c);
+    unsigned char c = char_pool[i];
+    keysyms_lookup_t* ksl_item = allowed[c];
     if (ksl_item == NULL) {
       argp_error(state, "CHARACTERS argument: unknown character: %c", c);
     }
     // don't allow duplicates in lookup
-    if (keysyms_lookup_find_char(input->ksl, size, c) == NULL) {
+    if (!used[c]) {
+      used[c] = 1;
       input->ksl[size] = *ksl_item;
       size += 1;
     }
@@ -1386,7 +6401,8 @@ parse_arg_characters(
   if (size < 2) {
     argp_error(state, "CHARACTERS argument: expected at least two characters");
   }
-  input->ksl = realloc(input->ksl, sizeof(keysyms_lookup_t) * size);
+  input->ksl =
+    xcw_realloc(HEAP_OTHER, input->ksl, sizeof(keysyms_lookup_t) * size);
   input->ksl_size = size;
 }
 
@@ -1410,7 +6426,8 @@ parse_arg_window_list(
     argp_error(state, "invalid value for window ID: %s", window_id);
   }
 
-  *windows = realloc(*windows, sizeof(xcb_window_t) * (*windows_size + 1));
+  *windows = xcw_realloc(
+    HEAP_OTHER, *windows, sizeof(xcb_window_t) * (*windows_size + 1));
   (*windows)[*windows_size] = window;
   *windows_size += 1;
 }
@@ -1433,6 +6450,24 @@ parse_arg_format(char* format, struct argp_state* state, xcw_input_t* input)
   }
 }
 
+/**
+ * Parse the `--anchor` option.  May call `argp_error`.
+ *
+ * anchor: value passed to the option
+ * input: result is placed in here
+ */
+void
+parse_arg_anchor(char* anchor, struct argp_state* state, xcw_input_t* input)
+{
+  for (int i = 0; i < ALL_ANCHORS_SIZE; i++) {
+    if (strcmp(anchor, ALL_ANCHORS[i].name) == 0) {
+      input->anchor = &(ALL_ANCHORS[i]);
+      return;
+    }
+  }
+  argp_error(state, "invalid value for anchor: %s", anchor);
+}
+
 /**
  * Parse the `--font-size` option.  May call `argp_error`.
  *
@@ -1493,6 +6528,35 @@ parse_arg(int key, char* value, struct argp_state* state)
   } else if (key == 't') {
     parse_arg_font_path(value, state, input);
     return 0;
+  } else if (key == 'o') {
+    input->shared_overlay = 1;
+    return 0;
+  } else if (key == 'd') {
+    input->daemon = 1;
+    return 0;
+  } else if (key == 'T') {
+    input->trigger = 1;
+    return 0;
+  } else if (key == 'S') {
+    input->socket_path = value;
+    return 0;
+  } else if (key == 'l') {
+    input->label_overlays = 1;
+    return 0;
+  } else if (key == 'm') {
+    input->timings = 1;
+    return 0;
+  } else if (key == 'M') {
+    input->multi = 1;
+    return 0;
+  } else if (key == 'x') {
+    input->stats = 1;
+    // count from here on
+    STATS.enabled = 1;
+    return 0;
+  } else if (key == 'a') {
+    parse_arg_anchor(value, state, input);
+    return 0;
   } else if (key == ARGP_KEY_ARG) {
     if (state->arg_num == 0) {
       parse_arg_characters(value, state, input);
@@ -1535,7 +6599,62 @@ parse_args(int argc, char** argv)
       't',
       "FONT-PATH",
       0,
-      "which font you want to use, please give the font(ttf) absolute path" },
+      "which font you want to use, please give the font(ttf) absolute path \
+(the core 'fixed' font is used if not given)" },
+    { "shared-overlay",
+      'o',
+      0,
+      0,
+      "draw every label on one shared overlay window instead of one window per \
+target window" },
+    { "daemon",
+      'd',
+      0,
+      0,
+      "keep running, and choose a window each time --trigger is run" },
+    { "trigger",
+      'T',
+      0,
+      0,
+      "ask the running daemon to choose a window, and print it (CHARACTERS and \
+other options are taken from the daemon)" },
+    { "label-overlays",
+      'l',
+      0,
+      0,
+      "cover only the label on each target window instead of the whole \
+window" },
+    { "anchor",
+      'a',
+      "ANCHOR",
+      0,
+      "where labels are placed on target windows: 'centre' (default), 'top', \
+'bottom', 'left', 'right', 'top-left', 'top-right', 'bottom-left' or \
+'bottom-right'" },
+    { "timings",
+      'm',
+      0,
+      0,
+      "print the time taken and X server round trips made by each phase to \
+stderr, on one line" },
+    { "multi",
+      'M',
+      0,
+      0,
+      "keep choosing windows, printing each one as it's chosen, until Enter or \
+Escape is pressed" },
+    { "stats",
+      'x',
+      0,
+      0,
+      "print heap usage, requests sent and X server resources used to stderr, \
+on one line" },
+    { "socket",
+      'S',
+      "PATH",
+      0,
+      "path of the daemon socket (defaults to $XDG_RUNTIME_DIR/\
+x-window-selector.sock)" },
     { 0 }
   };
 
@@ -1543,7 +6662,8 @@ parse_args(int argc, char** argv)
 Running the program draws a string of characters over each visible window.  \
 Typing one of those strings causes the program to print the corresponding \
 window ID to standard output and exit.  If any non-matching keys are pressed, \
-the program exits without printing anything.\n\
+the program exits without printing anything.  Windows of the classes chosen \
+most often are given the shortest strings.\n\
 \n\
 CHARACTERS defines the characters available for use in the displayed strings; \
 eg. 'asdfjkl' is a good choice for a QWERTY keyboard layout.  Allowed \
@@ -1554,59 +6674,74 @@ an unexpected error occurs.",
                          NULL,    NULL,      NULL };
 
   xcw_input_t input = { NULL, 0, NULL, 0 };
-  xcw_input_t* inputp = malloc(sizeof(xcw_input_t));
+  xcw_input_t* inputp = xcw_malloc(HEAP_OTHER, sizeof(xcw_input_t));
   *inputp = input;
+  inputp->anchor = &(ALL_ANCHORS[0]);
   argp_parse(&parser, argc, argv, 0, NULL, inputp);
-  if (inputp->ksl == NULL) {
+  if (inputp->ksl == NULL && !inputp->trigger) {
     xcw_fail(EX_USAGE, "missing CHARACTERS argument\n");
   }
+  if (inputp->daemon && inputp->trigger) {
+    xcw_fail(EX_USAGE, "--daemon and --trigger can't be used together\n");
+  }
+  if (inputp->daemon || inputp->trigger) {
+    daemon_socket_path_initialise(inputp);
+  }
+  inputp->blacklist_set =
+    xid_table_from_windows(inputp->blacklist, inputp->blacklist_size);
+  inputp->whitelist_set =
+    xid_table_from_windows(inputp->whitelist, inputp->whitelist_size);
   return inputp;
 }
 
 int
 main(int argc, char** argv)
 {
+  timings_initialise();
   xcw_input_t* input = parse_args(argc, argv);
+  timings_phase("parse_args");
+  if (input->trigger)
+    daemon_trigger(input);
+
   xcw_state_t* state;
   initialise_xorg(&state);
   state->input = input;
-  initialise_input(state);
-
-  xcb_window_t* windows;
-  int windows_size;
-  initialise_tracked_windows(state, &windows, &windows_size);
-  initialise_window_tracking(state, windows, windows_size);
-  free(windows);
-
-  if (state->wsetups_size == 0) {
-    xcw_exit_no_match();
-  } else if (state->wsetups_size == 1) {
-    wsetup_choose(state, &(state->wsetups[0]));
+  input_keymap_initialise(state);
+  window_atoms_initialise(state);
+  monitors_initialise(state);
+  history_load(&(state->history));
+  timings_phase("initialise_xorg");
+  initialise_label_font(state);
+  timings_phase("initialise_label_font");
+
+  if (input->daemon) {
+    daemon_listen(state);
+    monitors_watch(state);
+    live_windows_initialise(state);
+    glyph_cache_finish(state);
+    timings_phase("live_windows_initialise");
+    timings_print(input, state->xcon);
   } else {
-    overlays_set_text(state);
+    session_start(state);
   }
 
-  xcb_generic_event_t* event;
-  while (1)
-    if ((event = xcb_poll_for_event(state->xcon))) {
-      switch (event->response_type & ~0x80) {
-        case 0: {
-          xcb_generic_error_t* evterr = (xcb_generic_error_t*)event;
-          xcw_die("event loop error: %d\n", evterr->error_code);
-          break;
-        }
-        case XCB_EXPOSE: {
-          overlays_set_text(state);
-          break;
-        }
-        case XCB_KEY_PRESS: {
-          handle_keypress(state, (xcb_key_press_event_t*)event);
-          break;
-        }
-      }
-
+  for (;;) {
+    // read changes into the live window table once events stop arriving, so
+    // that the next session doesn't wait for the X server
+    int refresh =
+      (state->live != NULL && state->live->stale && state->client_fd < 0);
+    xcb_generic_event_t* event =
+      xorg_wait_for_event(state, refresh ? LIVE_REFRESH_DELAY : -1);
+    if (event != NULL) {
+      handle_event(state, event);
       free(event);
+      continue;
     }
+    if (refresh)
+      live_windows_refresh(state);
+    if (state->listen_fd >= 0)
+      daemon_accept(state);
+  }
 
   return 0;
 }